@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "src/regex.h"
+
+/*
+ * Times regcomp() and regnexec() over workloads and reports ns/op, MB/s and
+ * the peak heap (counted in alloc_fn) and stack (painted before the call)
+ * they take. Each timing repeats the call until BENCH_NSEC has passed.
+ */
+
+#define BENCH_NSEC   200000000LL // per timing
+#define STACK_PROBE  (512 * 1024) // stack depth painted, deeper use shows as this
+
+/*
+ * allocator counting the bytes in use and their peak.
+ * Each block has its size in front of it.
+ */
+static size_t heap_used, heap_peak;
+
+static void *
+count_alloc(void *ctx, size_t size)
+{
+  size_t *block = malloc(sizeof(size_t) * 2 + size);
+  (void)ctx;
+  if (!block) return NULL;
+  block[0] = size;
+  heap_used += size;
+  if (heap_used > heap_peak) heap_peak = heap_used;
+  return block + 2;
+}
+
+static void
+count_free(void *ctx, void *ptr)
+{
+  size_t *block = (size_t *)ptr - 2;
+  (void)ctx;
+  heap_used -= block[0];
+  free(block);
+}
+
+/* fills the stack below the caller with a pattern, to see later how deep it was overwritten */
+static uintptr_t painted; // address of the deepest painted byte
+
+static __attribute__((noinline)) void
+stack_paint(void)
+{
+  volatile unsigned char probe[STACK_PROBE];
+  size_t i;
+  for (i = 0; i < STACK_PROBE; i++) probe[i] = 0xA5;
+  painted = (uintptr_t)probe; // the stack grows down, probe[0] is the deepest
+}
+
+static size_t
+stack_peak(void)
+{
+  volatile unsigned char *probe = (volatile unsigned char *)painted;
+  size_t i;
+  for (i = 0; i < STACK_PROBE && probe[i] == 0xA5; i++);
+  return STACK_PROBE - i;
+}
+
+static long long
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef struct {
+  char *name;
+  char *regexp;
+  char *text;  // built by its maker
+  size_t len;
+} Workload;
+
+static char *
+repeat_text(const char *unit, size_t times, const char *tail)
+{
+  size_t ulen = strlen(unit), tlen = strlen(tail), i;
+  char *text = malloc(ulen * times + tlen + 1);
+  for (i = 0; i < times; i++) memcpy(text + ulen * i, unit, ulen);
+  strcpy(text + ulen * times, tail);
+  return text;
+}
+
+static void
+run(const Workload *w, const char *engine, int cflags)
+{
+  regex_t preg;
+  regmatch_t pmatch[8];
+  long long start, elapsed;
+  long ops;
+  double compile_ns, match_ns;
+  size_t stack;
+  int result;
+
+  /* compile */
+  start = now();
+  for (ops = 0; (elapsed = now() - start) < BENCH_NSEC / 4; ops++) {
+    regcomp(&preg, w->regexp, REG_EXTENDED | cflags, NULL, count_alloc, count_free);
+    regfree(&preg);
+  }
+  compile_ns = (double)elapsed / ops;
+
+  /* peak memory of one compile and match */
+  heap_used = heap_peak = 0;
+  regcomp(&preg, w->regexp, REG_EXTENDED | cflags, NULL, count_alloc, count_free);
+  stack_paint();
+  result = regnexec(&preg, w->text, w->len, 8, pmatch, 0);
+  stack = stack_peak();
+
+  /* match */
+  start = now();
+  for (ops = 0; ops == 0 || (elapsed = now() - start) < BENCH_NSEC; ops++) {
+    regnexec(&preg, w->text, w->len, 8, pmatch, 0);
+  }
+  match_ns = (double)elapsed / ops;
+  regfree(&preg);
+
+  printf("%-14s %-6s %-5s %10.0f %12.0f %9.1f %9zu %8zu%s\n",
+         w->name, engine, result == 0 ? "match" : "miss", compile_ns, match_ns,
+         w->len / match_ns * 1e9 / (1024 * 1024), heap_peak, stack,
+         stack >= STACK_PROBE ? "+" : "");
+}
+
+/*
+ * a set of count rules against calling regnexec() with each of them, on
+ * log lines of about 100 bytes, a quarter of them with a rule in them
+ */
+#define SET_LINES 64
+
+static void
+run_set(size_t count)
+{
+  char (*patterns)[32] = malloc(sizeof(*patterns) * count);
+  const char **rules = malloc(sizeof(char *) * count);
+  regex_t *pregs = malloc(sizeof(regex_t) * count);
+  uint32_t *matched = malloc(sizeof(uint32_t) * REGSET_WORDS(count));
+  char lines[SET_LINES][128];
+  regset_t set;
+  long long start, elapsed;
+  long ops;
+  double set_ns, loop_ns;
+  size_t i, heap;
+
+  for (i = 0; i < count; i++) {
+    sprintf(patterns[i], "rule%zu=([0-9]+);", i);
+    rules[i] = patterns[i];
+  }
+  for (i = 0; i < SET_LINES; i++) {
+    if (i % 4 == 0) {
+      sprintf(lines[i], "2026-10-17 12:%02zu:%02zu INFO host%zu rule%zu=%zu; rule%zu=x; request served",
+              i % 60, i * 7 % 60, i, i * 13 % 1000, i * 7, i * 3 % 800);
+    } else {
+      sprintf(lines[i], "2026-10-17 12:%02zu:%02zu INFO host%zu request /api/v%zu/items served in %zums status=200",
+              i % 60, i * 7 % 60, i, i % 3, i * 13 % 500);
+    }
+  }
+
+  heap_used = heap_peak = 0;
+  regset_comp(&set, rules, count, REG_EXTENDED, NULL, count_alloc, count_free);
+  start = now();
+  for (ops = 0; (elapsed = now() - start) < BENCH_NSEC; ops++) {
+    regset_exec(&set, lines[ops % SET_LINES], strlen(lines[ops % SET_LINES]), matched, 0);
+  }
+  set_ns = (double)elapsed / ops;
+  heap = heap_peak;
+  regset_free(&set);
+
+  for (i = 0; i < count; i++) regcomp(&pregs[i], rules[i], REG_EXTENDED | REG_NOSUB, NULL, count_alloc, count_free);
+  start = now();
+  for (ops = 0; (elapsed = now() - start) < BENCH_NSEC; ops++) {
+    for (i = 0; i < count; i++) regnexec(&pregs[i], lines[ops % SET_LINES], strlen(lines[ops % SET_LINES]), 0, NULL, 0);
+  }
+  loop_ns = (double)elapsed / ops;
+  for (i = 0; i < count; i++) regfree(&pregs[i]);
+
+  printf("%-14zu %14.0f %14.0f %9zu\n", count, set_ns, loop_ns, heap);
+  free(patterns);
+  free(rules);
+  free(pregs);
+  free(matched);
+}
+
+int match_date(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_kv(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_mail(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+
+/* a matcher regexgen made (see the Makefile) against regnexec() on its pattern */
+static void
+run_gen(const char *name, int (*matcher)(const char *, size_t, size_t, regmatch_t *),
+        const char *regexp, const char *text)
+{
+  regex_t preg;
+  regmatch_t pmatch[4];
+  size_t len = strlen(text);
+  long long start, elapsed;
+  long ops;
+  double gen_ns, exec_ns;
+  int result;
+
+  regcomp(&preg, regexp, REG_EXTENDED, NULL, count_alloc, count_free);
+  result = matcher(text, len, 4, pmatch);
+  start = now();
+  for (ops = 0; ops == 0 || (elapsed = now() - start) < BENCH_NSEC; ops++) matcher(text, len, 4, pmatch);
+  gen_ns = (double)elapsed / ops;
+  start = now();
+  for (ops = 0; ops == 0 || (elapsed = now() - start) < BENCH_NSEC; ops++) regnexec(&preg, text, len, 4, pmatch, 0);
+  exec_ns = (double)elapsed / ops;
+  regfree(&preg);
+
+  printf("%-14s %-5s %14.0f %14.0f\n", name, result == 0 ? "match" : "miss", gen_ns, exec_ns);
+}
+
+int
+main(void)
+{
+  Workload workloads[] = {
+    { "literal",      "needle" },
+    { "literal-miss", "needle" },
+    { "class",        "[a-z0-9._]+@[a-z]+\\.(com|org)" },
+    { "groups",       "((a|b)(c|d))+e" },
+    { "repeat",       "x[0-9]{2,5}y" },
+    { "backtrack",    "a*a*a*c$" },
+    { "nested",       "(a*)*b" },
+    { "long-log",     "ERROR: ([0-9]+)" },
+  };
+  workloads[0].text = repeat_text("haystack hay ", 1000, "needle");
+  workloads[1].text = repeat_text("haystack hay ", 1000, "");
+  workloads[2].text = repeat_text("contact: nobody at example dot com ", 200, "me.x@example.org");
+  workloads[3].text = repeat_text("acbdadbc", 500, "e");
+  workloads[4].text = repeat_text("x1y2 x123456y ", 500, "x1234y");
+  workloads[5].text = repeat_text("a", 100, "bc"); // every split of the a's is tried at each start
+  workloads[6].text = repeat_text("a", 5000, "!b");
+  workloads[7].text = repeat_text("2026-10-17 INFO request served in 12ms\n", 25000, "2026-10-17 ERROR: 42\n");
+  int i, n = sizeof(workloads) / sizeof(workloads[0]);
+
+  printf("%-14s %-6s %-5s %10s %12s %9s %9s %8s\n",
+         "workload", "engine", "", "compile ns", "match ns/op", "MB/s", "heap B", "stack B");
+  for (i = 0; i < n; i++) {
+    workloads[i].len = strlen(workloads[i].text);
+    run(&workloads[i], "auto", 0);
+    run(&workloads[i], "pike", REG_PIKEVM);
+    run(&workloads[i], "dfa", REG_NOSUB);
+    free(workloads[i].text);
+  }
+
+  /* the set should cost about the same per line whatever the number of rules */
+  size_t counts[] = { 1, 10, 100, 300, 1000 };
+  printf("\n%-14s %14s %14s %9s\n", "regset rules", "set ns/line", "loop ns/line", "heap B");
+  for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) run_set(counts[i]);
+
+  /* 1 MiB of log lines, with the match at the end or none */
+  char *hit = repeat_text("10:17 INFO kafka worker key: k=12 keys=ok kind=x\n", 21400,
+                          "2026-10-17 key=done; me@example.org\n");
+  char *miss = repeat_text("10:17 INFO kafka worker key: k=12 keys=ok kind=x\n", 21400, "");
+  printf("\n%-14s %-5s %14s %14s\n", "generated", "", "gen ns/op", "regnexec ns/op");
+  run_gen("date", match_date, "([0-9]+)-([0-9]+)-([0-9]+)", hit);
+  run_gen("date-miss", match_date, "([0-9]+)-([0-9]+)-([0-9]+)", miss);
+  run_gen("kv", match_kv, "key=([a-z]+);", hit);
+  run_gen("kv-miss", match_kv, "key=([a-z]+);", miss);
+  run_gen("mail", match_mail, "[^ @]+@[a-z]+\\.(com|org)", hit);
+  run_gen("mail-miss", match_mail, "[^ @]+@[a-z]+\\.(com|org)", miss);
+  free(hit);
+  free(miss);
+  return 0;
+}
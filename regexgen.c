@@ -0,0 +1,442 @@
+/*
+ * regexgen: turns patterns into C matcher functions
+ *
+ *   regexgen [-N] name pattern [[-N] name pattern]... > matchers.c
+ *
+ * Each function is
+ *
+ *   int name(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+ *
+ * and answers like regnexec() on the pattern compiled with REG_EXTENDED
+ * (and REG_NEWLINE for -N). The NFA program of the pattern is written out
+ * as straight-line code, one label per jump target, and run as a
+ * backtracker. Texts without the literal every match contains are
+ * rejected, and start positions are skipped to the next place it or a
+ * byte a match can start with is, as regnexec() does. Once a search has
+ * reached more labels than there are (label, position) pairs, a bitmap of
+ * the pairs already tried is made and the attempt started again with it,
+ * which keeps it linear in the text like the Pike VM. Memory comes from
+ * REGEX_GEN_ALLOC() and REGEX_GEN_FREE(), malloc() and free() unless
+ * defined before the generated code; a search that doesn't backtrack far
+ * takes none.
+ */
+#include <stdlib.h>
+#include "src/regex.c"
+
+static void *libc_alloc(void *ctx, size_t size) { (void)ctx; return malloc(size); }
+static void libc_free(void *ctx, void *ptr) { (void)ctx; free(ptr); }
+
+static const char prelude[] =
+  "/* generated by regexgen, do not edit */\n"
+  "#include <stdint.h>\n"
+  "#include <stdlib.h>\n"
+  "#include <string.h>\n"
+  "#if defined(__SSE2__)\n"
+  "#include <emmintrin.h>\n"
+  "#elif defined(__ARM_NEON)\n"
+  "#include <arm_neon.h>\n"
+  "#endif\n"
+  "#include \"regex.h\"\n"
+  "\n"
+  "#ifndef REGEX_GEN_ALLOC\n"
+  "#define REGEX_GEN_ALLOC(size) malloc(size)\n"
+  "#define REGEX_GEN_FREE(ptr) free(ptr)\n"
+  "#endif\n"
+  "\n"
+  "#define REGEX_GEN_STACK 64 // pairs on the C stack, more of them are allocated\n"
+  "\n"
+  "/* backtrack stack of (label, position) or (-1 - slot, old value) pairs */\n"
+  "static regoff_t *\n"
+  "regex_gen_grow(regoff_t *stack, const regoff_t *local, size_t *capa)\n"
+  "{\n"
+  "  regoff_t *grown = REGEX_GEN_ALLOC(sizeof(regoff_t) * 4 * *capa);\n"
+  "  if (!grown) return NULL;\n"
+  "  memcpy(grown, stack, sizeof(regoff_t) * 2 * *capa);\n"
+  "  if (stack != local) REGEX_GEN_FREE(stack);\n"
+  "  *capa *= 2;\n"
+  "  return grown;\n"
+  "}\n"
+  "\n"
+  "/*\n"
+  " * first place of lit[n] in t[len], NULL if none. Like scan_literal() in\n"
+  " * regex.c the vectorized loop compares the first and the last byte of lit\n"
+  " * at 16 positions at once and memcmp()s only where both of them match.\n"
+  " */\n"
+  "static const unsigned char *\n"
+  "regex_gen_find(const unsigned char *t, size_t len, const unsigned char *lit, size_t n)\n"
+  "{\n"
+  "  const unsigned char *last_start; // last position lit can start at\n"
+  "  if (len < n) return NULL;\n"
+  "  if (n == 1) return memchr(t, lit[0], len);\n"
+  "  last_start = t + len - n;\n"
+  "#if defined(__SSE2__)\n"
+  "  {\n"
+  "    const __m128i first = _mm_set1_epi8((char)lit[0]);\n"
+  "    const __m128i last = _mm_set1_epi8((char)lit[n - 1]);\n"
+  "    for (; t + 16 <= last_start + 1; t += 16) {\n"
+  "      uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(\n"
+  "        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)t), first),\n"
+  "        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(t + n - 1)), last)));\n"
+  "      while (mask) {\n"
+  "        int i = __builtin_ctz(mask);\n"
+  "        if (memcmp(t + i + 1, lit + 1, n - 1) == 0) return t + i;\n"
+  "        mask &= mask - 1;\n"
+  "      }\n"
+  "    }\n"
+  "  }\n"
+  "#elif defined(__ARM_NEON)\n"
+  "  {\n"
+  "    const uint8x16_t first = vdupq_n_u8(lit[0]);\n"
+  "    const uint8x16_t last = vdupq_n_u8(lit[n - 1]);\n"
+  "    for (; t + 16 <= last_start + 1; t += 16) {\n"
+  "      uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(t), first),\n"
+  "                               vceqq_u8(vld1q_u8(t + n - 1), last));\n"
+  "      /* narrow to 4 bits per byte since NEON has no movemask */\n"
+  "      uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(\n"
+  "        vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);\n"
+  "      while (mask) {\n"
+  "        int i = __builtin_ctzll(mask) >> 2;\n"
+  "        if (memcmp(t + i + 1, lit + 1, n - 1) == 0) return t + i;\n"
+  "        mask &= ~(0xFULL << (i << 2));\n"
+  "      }\n"
+  "    }\n"
+  "  }\n"
+  "#endif\n"
+  "  /* scalar fallback, also the tail of the vectorized loop */\n"
+  "  while (t <= last_start) {\n"
+  "    t = memchr(t, lit[0], last_start - t + 1);\n"
+  "    if (!t) return NULL;\n"
+  "    if (memcmp(t + 1, lit + 1, n - 1) == 0) return t;\n"
+  "    t++;\n"
+  "  }\n"
+  "  return NULL;\n"
+  "}\n"
+  "\n"
+  "#define REGEX_GEN_PUSH(a, b) do { \\\n"
+  "    if (depth == capa) { \\\n"
+  "      regoff_t *grown = regex_gen_grow(stack, local, &capa); \\\n"
+  "      if (!grown) goto done; \\\n"
+  "      stack = grown; \\\n"
+  "    } \\\n"
+  "    stack[2 * depth] = (a); \\\n"
+  "    stack[2 * depth + 1] = (b); \\\n"
+  "    depth++; \\\n"
+  "  } while (0)\n"
+  "\n"
+  "/*\n"
+  " * goes on only the first time label k is reached at sp. The bitmap of\n"
+  " * nlabel (label, position) pairs is made once more labels than that have\n"
+  " * been reached, and the attempt at start is made again with it.\n"
+  " */\n"
+  "#define REGEX_GEN_VISIT(k, nlabel) do { \\\n"
+  "    size_t bit = (size_t)(k) * (len + 1) + sp; \\\n"
+  "    if (!visited) { \\\n"
+  "      if (++visits <= (size_t)(nlabel) * (len + 1)) break; \\\n"
+  "      visited = REGEX_GEN_ALLOC((nlabel) * (len + 1) / 8 + 1); \\\n"
+  "      if (!visited) goto done; \\\n"
+  "      memset(visited, 0, (nlabel) * (len + 1) / 8 + 1); \\\n"
+  "      goto restart; \\\n"
+  "    } \\\n"
+  "    if (visited[bit >> 3] & (1 << (bit & 7))) goto fail; \\\n"
+  "    visited[bit >> 3] |= 1 << (bit & 7); \\\n"
+  "  } while (0)\n";
+
+#define GEN_RANGE_MAX 4 // ranges compared before a bitmap table is used
+
+/* ranges of set, or of its complement if negate. Stops after GEN_RANGE_MAX + 1 */
+static int
+gen_ranges(const bool *set, bool negate, int *lo, int *hi)
+{
+  int n = 0, b;
+  for (b = 0; b < 256 && n <= GEN_RANGE_MAX; b++) {
+    if (set[b] == negate || (b > 0 && set[b - 1] != negate)) continue;
+    lo[n] = b;
+    for (hi[n] = b; hi[n] < 255 && set[hi[n] + 1] != negate; hi[n]++);
+    n++;
+  }
+  return n;
+}
+
+static bool
+gen_needs_table(const bool *set)
+{
+  int lo[GEN_RANGE_MAX + 1], hi[GEN_RANGE_MAX + 1];
+  return gen_ranges(set, false, lo, hi) > GEN_RANGE_MAX && gen_ranges(set, true, lo, hi) > GEN_RANGE_MAX;
+}
+
+/*
+ * C expression telling if the byte c is in set. The ranges of the set or of
+ * its complement are compared, or the bitmap table is looked up if they are many.
+ */
+static void
+gen_cond(FILE *out, const bool *set, const char *c, const char *table)
+{
+  int lo[GEN_RANGE_MAX + 1], hi[GEN_RANGE_MAX + 1], n, i;
+  bool negate = false;
+  n = gen_ranges(set, false, lo, hi);
+  if (n > GEN_RANGE_MAX) {
+    negate = true;
+    n = gen_ranges(set, true, lo, hi);
+  }
+  if (n > GEN_RANGE_MAX) {
+    fprintf(out, "(%s[%s >> 3] & (1 << (%s & 7)))", table, c, c);
+    return;
+  }
+  if (n == 0) {
+    fprintf(out, negate ? "1" : "0");
+    return;
+  }
+  fprintf(out, negate ? "!(" : "(");
+  for (i = 0; i < n; i++) {
+    if (i > 0) fprintf(out, " || ");
+    if (lo[i] == hi[i]) {
+      fprintf(out, "%s == 0x%02x", c, lo[i]);
+    } else if (lo[i] == 0) {
+      fprintf(out, "%s <= 0x%02x", c, hi[i]);
+    } else if (hi[i] == 255) {
+      fprintf(out, "%s >= 0x%02x", c, lo[i]);
+    } else {
+      fprintf(out, "(%s >= 0x%02x && %s <= 0x%02x)", c, lo[i], c, hi[i]);
+    }
+  }
+  fprintf(out, ")");
+}
+
+static void
+gen_table(FILE *out, const bool *set, const char *name)
+{
+  int i, b;
+  fprintf(out, "  static const unsigned char %s[32] = {", name);
+  for (i = 0; i < 32; i++) {
+    int byte = 0;
+    for (b = 0; b < 8; b++) byte |= set[i * 8 + b] << b;
+    fprintf(out, "%s0x%02x", i ? ", " : " ", byte);
+  }
+  fprintf(out, " };\n");
+}
+
+static void
+ccl_bools(const unsigned char *ccl, bool *set)
+{
+  int b;
+  for (b = 0; b < 256; b++) set[b] = ccl_match(ccl, b);
+}
+
+/* label of pc, -1 if nothing jumps there */
+static void
+gen_labels(const ReProg *prog, int *label, int *nlabel)
+{
+  int pc, i;
+  const ReInst *ip;
+  for (pc = 0; pc < prog->len; pc++) label[pc] = -1;
+  label[0] = 0;
+  for (pc = 0; pc < prog->len; pc++) {
+    ip = &prog->inst[pc];
+    if (ip->op == RE_OP_SPLIT) {
+      label[ip->x] = label[ip->y] = 0;
+    } else if (ip->op == RE_OP_JMP) {
+      label[ip->x] = 0;
+    } else if (ip->op == RE_OP_ALT) {
+      for (i = 0; i < RE_ALT(ip)->nbranch; i++) label[RE_ALT(ip)->pc[i]] = 0;
+    }
+  }
+  *nlabel = 0;
+  for (pc = 0; pc < prog->len; pc++) {
+    if (label[pc] == 0) label[pc] = (*nlabel)++;
+  }
+}
+
+static void
+gen_matcher(FILE *out, const char *name, const char *pattern, const regex_t *preg)
+{
+  const ReProg *prog = preg->prog;
+  const ReLit *lit = preg->lit;
+  int nslot = 2 * (int)(preg->re_nsub + 1);
+  int *label = malloc(sizeof(int) * prog->len);
+  bool *seen = calloc(prog->len, sizeof(bool));
+  uint64_t first[257] = { 0 };
+  bool set[256];
+  char table[32];
+  int pc, i, nlabel, nfirst = 0, only = -1;
+  const ReInst *ip;
+  const char *p;
+
+  gen_labels(prog, label, &nlabel);
+  prog_first(prog, 0, 1, first, seen);
+  for (i = 0; i < 256; i++) {
+    set[i] = first[i] != 0;
+    if (set[i]) {
+      nfirst++;
+      only = i;
+    }
+  }
+
+  /* the pattern on a line of its own, so that a * at its end can't close the comment */
+  fprintf(out, "\n/*\n * pattern: ");
+  for (p = pattern; *p; p++) {
+    fputc(*p, out);
+    if (p[0] == '*' && p[1] == '/') fputc('\\', out); // not to end the comment
+  }
+  fprintf(out, "\n */\nint\n%s(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch)\n{\n", name);
+  for (pc = 0; pc < prog->len; pc++) {
+    if (prog->inst[pc].op != RE_OP_CLASS) continue;
+    ccl_bools(RE_CCL(&prog->inst[pc]), set);
+    sprintf(table, "ccl%d", pc);
+    if (gen_needs_table(set)) gen_table(out, set, table);
+  }
+  for (i = 0; i < 256; i++) set[i] = first[i] != 0;
+  if (nfirst > 1 && nfirst < 256 && gen_needs_table(set)) gen_table(out, set, "first");
+  if (lit) {
+    fprintf(out, "  static const unsigned char lit[%d] = {", lit->len);
+    for (i = 0; i < lit->len; i++) fprintf(out, "%s0x%02x", i ? ", " : " ", lit->str[i]);
+    fprintf(out, " };\n");
+  }
+  fprintf(out,
+    "  const unsigned char *t = (const unsigned char *)text;\n"
+    "  regoff_t caps[%d], local[2 * REGEX_GEN_STACK], *stack = local;\n"
+    "  size_t depth = 0, capa = REGEX_GEN_STACK, sp, start, i, visits = 0;\n"
+    "  unsigned char *visited = NULL;\n"
+    "  int result = -1;\n"
+    "\n", nslot);
+  /* the literal every match contains, as prefilter() looks for it */
+  if (lit && lit->prefix && prog->anchored) {
+    fprintf(out, "  if (len < %d || memcmp(t, lit, %d) != 0) return -1;\n", lit->len, lit->len);
+  } else if (lit && !lit->prefix) {
+    fprintf(out, "  if (!regex_gen_find(t, len, lit, %d)) return -1;\n", lit->len);
+  }
+  fprintf(out, "  for (start = 0; start <= %s; start++) {\n", prog->anchored ? "0" : "len");
+  /* skip the positions no match can start at */
+  if (lit && lit->prefix && !prog->anchored) {
+    fprintf(out,
+      "    {\n"
+      "      const unsigned char *p = regex_gen_find(t + start, len - start, lit, %d);\n"
+      "      if (!p) break;\n"
+      "      start = (size_t)(p - t);\n"
+      "    }\n", lit->len);
+  } else if (nfirst == 1) {
+    fprintf(out,
+      "    if (start < len && t[start] != 0x%02x) {\n"
+      "      const unsigned char *p = memchr(t + start, 0x%02x, len - start);\n"
+      "      start = p ? (size_t)(p - t) : len;\n"
+      "    }\n", only, only);
+  } else if (nfirst < 256) {
+    fprintf(out, "    if (start < len && !");
+    gen_cond(out, set, "t[start]", "first");
+    fprintf(out, ") continue;\n");
+  }
+  if (!first[256]) fprintf(out, "    if (start == len) break;\n");
+  fprintf(out,
+    "  restart:\n"
+    "    depth = 0;\n"
+    "    for (i = 0; i < %d; i++) caps[i] = -1;\n"
+    "    sp = start;\n"
+    "    goto L0;\n"
+    "  fail:\n"
+    "    while (depth > 0) {\n"
+    "      depth--;\n"
+    "      if (stack[2 * depth] < 0) {\n"
+    "        caps[-1 - stack[2 * depth]] = stack[2 * depth + 1];\n"
+    "        continue;\n"
+    "      }\n"
+    "      sp = (size_t)stack[2 * depth + 1];\n"
+    "      switch (stack[2 * depth]) {\n", nslot);
+  for (pc = 0; pc < prog->len; pc++) {
+    if (label[pc] >= 0) fprintf(out, "        case %d: goto L%d;\n", pc, pc);
+  }
+  fprintf(out, "      }\n    }\n    continue;\n");
+
+  for (pc = 0; pc < prog->len; pc++) {
+    ip = &prog->inst[pc];
+    if (label[pc] >= 0) fprintf(out, "  L%d:\n    REGEX_GEN_VISIT(%d, %d);\n", pc, label[pc], nlabel);
+    switch (ip->op) {
+      case RE_OP_CHAR:
+        fprintf(out, "    if (sp >= len || t[sp] != 0x%02x) goto fail;\n    sp++;\n", ip->ch);
+        break;
+      case RE_OP_ANY:
+        fprintf(out, "    if (sp >= len) goto fail;\n    sp++;\n");
+        break;
+      case RE_OP_CLASS:
+        ccl_bools(RE_CCL(ip), set);
+        sprintf(table, "ccl%d", pc);
+        fprintf(out, "    if (sp >= len || !");
+        gen_cond(out, set, "t[sp]", table);
+        fprintf(out, ") goto fail;\n    sp++;\n");
+        break;
+      case RE_OP_BOL:
+        fprintf(out, prog->newline ? "    if (sp > 0 && t[sp - 1] != 0x0a) goto fail;\n"
+                                   : "    if (sp > 0) goto fail;\n");
+        break;
+      case RE_OP_EOL:
+        fprintf(out, prog->newline ? "    if (sp < len && t[sp] != 0x0a) goto fail;\n"
+                                   : "    if (sp < len) goto fail;\n");
+        break;
+      case RE_OP_SAVE:
+        if (ip->n >= nslot) break;
+        fprintf(out, "    REGEX_GEN_PUSH(%d, caps[%d]);\n    caps[%d] = (regoff_t)sp;\n",
+                -1 - ip->n, ip->n, ip->n);
+        break;
+      case RE_OP_SPLIT:
+        fprintf(out, "    REGEX_GEN_PUSH(%d, (regoff_t)sp);\n    goto L%d;\n", ip->y, ip->x);
+        break;
+      case RE_OP_JMP:
+        fprintf(out, "    goto L%d;\n", ip->x);
+        break;
+      case RE_OP_ALT:
+        /* branches in order of priority */
+        for (i = RE_ALT(ip)->nbranch - 1; i > 0; i--)
+          fprintf(out, "    REGEX_GEN_PUSH(%d, (regoff_t)sp);\n", RE_ALT(ip)->pc[i]);
+        fprintf(out, "    goto L%d;\n", RE_ALT(ip)->pc[0]);
+        break;
+      case RE_OP_MATCH:
+        fprintf(out,
+          "    for (i = 0; i < nmatch; i++) {\n"
+          "      pmatch[i].rm_so = 2 * i < %d ? caps[2 * i] : -1;\n"
+          "      pmatch[i].rm_eo = 2 * i < %d ? caps[2 * i + 1] : -1;\n"
+          "    }\n"
+          "    result = 0;\n"
+          "    break;\n", nslot, nslot);
+        break;
+    }
+  }
+  fprintf(out,
+    "  }\n"
+    "done:\n"
+    "  if (stack != local) REGEX_GEN_FREE(stack);\n"
+    "  if (visited) REGEX_GEN_FREE(visited);\n"
+    "  return result;\n"
+    "}\n");
+  free(label);
+  free(seen);
+}
+
+int
+main(int argc, char **argv)
+{
+  regex_t preg;
+  int i, cflags = 0;
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s [-N] name pattern [[-N] name pattern]...\n", argv[0]);
+    return 1;
+  }
+  printf("%s", prelude);
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-N") == 0) {
+      cflags |= REG_NEWLINE;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "%s: no pattern for %s\n", argv[0], argv[i]);
+      return 1;
+    }
+    if (regcomp(&preg, argv[i + 1], REG_EXTENDED | REG_PIKEVM | cflags, NULL, libc_alloc, libc_free) != 0 ||
+        !preg.prog) {
+      fprintf(stderr, "%s: can't compile /%s/\n", argv[0], argv[i + 1]);
+      return 1;
+    }
+    gen_matcher(stdout, argv[i], argv[i + 1], &preg);
+    regfree(&preg);
+    cflags = 0;
+    i++;
+  }
+  return 0;
+}
@@ -1,6 +1,12 @@
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "./regex.h"
 
 
@@ -17,626 +23,2427 @@ typedef enum {
   RE_TYPE_BRACKET,  // [ ]
   RE_TYPE_LPAREN,   // (
   RE_TYPE_RPAREN,   // )
+  RE_TYPE_ALT,      // |
 } ReType;
 
 /*
  * An element of Regular Expression Tree
+ * Sets are referred to by their offset from the referring atom or
+ * instruction, so a compiled pattern holds no pointer and can be moved as
+ * a whole (see regsave()).
  */
 typedef struct re_atom {
   ReType type;
   union {
     unsigned char ch;   // literal in RE_TYPE_LIT
-    unsigned char *ccl; // pointer to content in [ ] RE_TYPE_BRACKET
-    struct { uint8_t min; uint8_t max; } repeat; // RE_TYPE_REPEAT: max==0 means unbounded
+    int32_t ccl;        // RE_TYPE_BRACKET: offset of its 256-bit set, see RE_CCL()
+    struct {
+      uint8_t min;        // RE_TYPE_REPEAT: max==0 means unbounded
+      uint8_t max;
+      uint8_t possessive; // any quantifier: followed by +, gives nothing back
+    } repeat;
+    struct {
+      uint32_t span;    // RE_TYPE_LPAREN: offset to the matching RE_TYPE_RPAREN, 0 if none
+      uint32_t nsub;    // RE_TYPE_LPAREN: number of the group, counted from 1, 0 for (?>...)
+    };
   };
 } ReAtom;
 
+#define RE_CCL(p) ((const unsigned char *)(p) + (p)->ccl) // set of an atom or instruction
+
+/*
+ * Instruction of the NFA program run by the Pike VM
+ */
+typedef enum {
+  RE_OP_MATCH = 0,
+  RE_OP_CHAR,       // literal
+  RE_OP_ANY,        // .
+  RE_OP_CLASS,      // [ ]
+  RE_OP_BOL,        // ^
+  RE_OP_EOL,        // $
+  RE_OP_SAVE,       // record position into capture slot n
+  RE_OP_SPLIT,      // fork to x and y, x has priority
+  RE_OP_JMP,        // goto x
+  RE_OP_ALT,        // fork to the branches that can start with the next byte
+} ReOp;
+
+#define RE_ALT_MAX 64 // branches a dispatch table can hold
+
+/*
+ * First-byte dispatch table of an alternation
+ * Bit i of first[c] is set if branch i can match at a position where the
+ * next byte is c. first[256] is for the end of text.
+ */
+typedef struct re_alt {
+  uint64_t first[257];
+  uint16_t nbranch;
+  uint16_t pc[RE_ALT_MAX]; // first instruction of each branch
+} ReAlt;
+
+typedef struct re_inst {
+  uint8_t op;
+  union {
+    unsigned char ch;   // RE_OP_CHAR
+    int32_t ccl;        // RE_OP_CLASS: offset of its set, see RE_CCL()
+    uint16_t n;         // RE_OP_SAVE, RE_OP_MATCH: pattern id in a regset_t
+    struct { uint16_t x; uint16_t y; }; // RE_OP_SPLIT, RE_OP_JMP
+    int32_t alt;        // RE_OP_ALT: offset of its table, see RE_ALT()
+  };
+} ReInst;
+
+#define RE_ALT(ip) ((const ReAlt *)((const char *)(ip) + (ip)->alt))
+
+typedef struct re_prog {
+  uint32_t size; // bytes of the whole program
+  uint16_t len;
+  bool anchored; // starts with ^
+  bool newline;  // REG_NEWLINE: ^ and $ also match at line breaks
+  uint16_t nclass;           // number of byte classes
+  uint8_t byteclass[256];    // bytes no instruction can tell apart share a class
+  ReInst inst[];
+  /* followed by ReAlt of each RE_OP_ALT and the set of each RE_OP_CLASS */
+} ReProg;
+
+#define RE_PROG_MAX 0xFFFF
+
+/*
+ * Literal string that every match contains
+ */
+typedef struct re_lit {
+  bool prefix;   // every match starts with it
+  uint16_t len;
+  unsigned char str[];
+} ReLit;
+
+#define RE_LIT_MAX 64
+#define RE_DFA_CACHE_SIZE 4096
+#define RE_SET_DFA_CACHE_SIZE 0x40000 // at least, see RE_SET_DFA_CACHE_PER_PATTERN
+#define RE_SET_DFA_CACHE_PER_PATTERN 0x400 // states grow with the patterns, so does their cache
+#define RE_STREAM_HISTORY 4096
+
+/*
+ * State of the lazy DFA: a set of NFA program counters
+ */
+typedef struct re_dfa_state {
+  struct re_dfa_state *link; // all states in the cache
+  uint32_t hash;
+  uint16_t npc;
+  bool match;      // RE_OP_MATCH is reached here
+  bool eol_match;  // RE_OP_MATCH is reached if here is the end of text
+  uint32_t reported; // run of regset_exec() that has taken the pattern ids matching here
+  bool bol;        // at the start of a line, which a pending $ can be followed by ^ at
+  struct re_dfa_state *next[]; // per byte class, NULL until computed
+  /* followed by uint16_t pc[npc] */
+} ReDfaState;
+
+typedef struct re_dfa {
+  const ReProg *prog;
+  ReDfaState *states;
+  char *cache;
+  size_t cache_size;
+  size_t cache_used;
+  uint16_t *set;   // pcs of the state being built
+  int nset;
+  uint32_t *mark;  // generation at which each pc has been added last
+  uint32_t gen;
+  uint32_t run;    // calls of regset_exec() on it, see ReDfaState.reported
+  struct re_dfa_state *start[2]; // state a run starts in, at the start of a line or not, NULL until made
+} ReDfa;
+
+typedef struct re_trail {
+  int slot;
+  regoff_t value; // value of the slot before it was overwritten
+} ReTrail;
+
+#define RE_TRAIL_INIT 32
+#define RE_CAPS_INIT 32 // slots on the stack, more of them are allocated
+
+typedef enum {
+  RE_FRAME_RESUME, // go on from regexp at text
+  RE_FRAME_STAR,   // go on from regexp with one repetition less, down to text
+  RE_FRAME_GROUP,  // the content of a group is being matched
+} ReFrameKind;
+
+/*
+ * Choice point of the backtracker
+ * Going back to a frame rolls the trail back to its mark.
+ */
+typedef struct re_frame {
+  ReFrameKind kind;
+  int mark;            // trail length when the frame was pushed
+  int count;           // RE_FRAME_GROUP: repetitions of the group before this one
+  int prev;            // frame of the group being matched when pushed, -1 if none
+  const ReAtom *regexp; // RE_FRAME_GROUP: the (
+  const ReAtom *end;   // ) of the group regexp is in, NULL at the top level
+  const char *text;    // RE_FRAME_GROUP: where the repetition starts
+  const char *pos;     // RE_FRAME_STAR: end of the repetitions to try next
+} ReFrame;
+
+#define RE_FRAMES_INIT 32
+
 typedef struct re_state {
-  char *original_text_top_addr;
-  int current_re_nsub;
-  int max_re_nsub;
-  int *match_index_data;
-  int nsub_stack[10];
-  int nsub_stack_ptr;
+  const regex_t *preg;
+  const char *original_text_top_addr;
+  const char *text_end;
+  regoff_t *caps; // start and end offsets of each group, -1 until it matches
+  int nslot;   // 2 * (re_nsub + 1)
+  ReTrail *trail; // undo log of the slots
+  int trail_len;
+  int trail_capa;
+  bool nomem;  // the trail or the frames could not grow
+  ReFrame *frames; // backtrack stack
+  int nframe;
+  int frames_capa;
+  int group;   // frame of the innermost group being matched, -1 if none
+  size_t steps; // atoms that may still be tried, 0 once the budget ran out
 } ReState;
 
-static int match(ReState *rs, ReAtom *regexp, const char *text, ReAtom *start);
-static int matchstar(ReState *rs, ReAtom *c, ReAtom *regexp, const char *text, ReAtom *start);
-static int matchhere(ReState *rs, ReAtom *regexp, const char *text, ReAtom *start);
-static int matchone(ReState *rs, ReAtom *p, const char *text);
-static int matchquestion(ReState *rs, ReAtom *regexp, const char *text, ReAtom *start);
-static int match_group_question(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start);
-static int match_group_star(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start);
-static int match_group_plus(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start);
-static int matchrepeat(ReState *rs, ReAtom *c, ReAtom *regexp, const char *text, ReAtom *start);
-static int match_group_repeat(ReState *rs, ReAtom *lparen, ReAtom *rparen, ReAtom *repeat_atom, const char *text, ReAtom *start);
-static int match_group_content_once(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start);
-static int matchchars(ReState *rs, const unsigned char *s, const char *text);
-static int matchbetween(const unsigned char *s, const char *text);
-static ReAtom* find_rparen(ReAtom *lparen);
+static const char *matchhere(ReState *rs, const ReAtom *regexp, const char *text);
+static int matchone(ReState *rs, const ReAtom *p, const char *text);
+static int matchchars(ReState *rs, const unsigned char *set, const char *text);
+static inline bool ccl_match(const unsigned char *set, unsigned char c);
+static ReAtom* find_rparen(const ReAtom *lparen);
+
+static ReAtom*
+find_rparen(const ReAtom *lparen) {
+  return lparen->span ? (ReAtom *)lparen + lparen->span : NULL;
+}
 
+/*
+ * next | of the same level from p, NULL if none before end.
+ * Groups are skipped over.
+ */
 static ReAtom*
-find_rparen(ReAtom *lparen) {
-  ReAtom *p = lparen + 1;
-  int level = 1;
-  while (p->type != RE_TYPE_TERM) {
-    if (p->type == RE_TYPE_LPAREN) level++;
-    else if (p->type == RE_TYPE_RPAREN) {
-      level--;
-      if (level == 0) return p;
+find_alt(const ReAtom *p, const ReAtom *end)
+{
+  for (; p != end && p->type != RE_TYPE_TERM; p++) {
+    if (p->type == RE_TYPE_ALT) return (ReAtom *)p;
+    if (p->type == RE_TYPE_LPAREN && p->span) p += p->span;
+  }
+  return NULL;
+}
+
+/* end of the (sub)expression being matched */
+static inline bool
+at_end(const ReAtom *regexp, const ReAtom *end)
+{
+  return regexp == end || regexp->type == RE_TYPE_TERM;
+}
+
+/*
+ * literal scanner
+ * Finds the first occurrence of lit in text. The vectorized loops compare
+ * the first and the last byte of lit at 16 or 32 positions at once and
+ * memcmp() only the positions where both of them match.
+ */
+static const char *
+scan_literal(const char *text, const char *text_end, const ReLit *lit)
+{
+  const unsigned char *t = (const unsigned char *)text;
+  const unsigned char *last_start; // last position lit can start at
+  size_t n = lit->len;
+  if (text_end - text < (ptrdiff_t)n) return NULL;
+  last_start = (const unsigned char *)text_end - n;
+#if defined(__AVX2__)
+  {
+    const __m256i first = _mm256_set1_epi8((char)lit->str[0]);
+    const __m256i last = _mm256_set1_epi8((char)lit->str[n - 1]);
+    for (; t + 32 <= last_start + 1; t += 32) {
+      __m256i b0 = _mm256_loadu_si256((const __m256i *)t);
+      __m256i b1 = _mm256_loadu_si256((const __m256i *)(t + n - 1));
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(b0, first), _mm256_cmpeq_epi8(b1, last)));
+      while (mask) {
+        int i = __builtin_ctz(mask);
+        if (memcmp(t + i + 1, lit->str + 1, n - 1) == 0) return (const char *)(t + i);
+        mask &= mask - 1;
+      }
+    }
+  }
+#elif defined(__SSE2__)
+  {
+    const __m128i first = _mm_set1_epi8((char)lit->str[0]);
+    const __m128i last = _mm_set1_epi8((char)lit->str[n - 1]);
+    for (; t + 16 <= last_start + 1; t += 16) {
+      __m128i b0 = _mm_loadu_si128((const __m128i *)t);
+      __m128i b1 = _mm_loadu_si128((const __m128i *)(t + n - 1));
+      uint32_t mask = (uint32_t)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(b0, first), _mm_cmpeq_epi8(b1, last)));
+      while (mask) {
+        int i = __builtin_ctz(mask);
+        if (memcmp(t + i + 1, lit->str + 1, n - 1) == 0) return (const char *)(t + i);
+        mask &= mask - 1;
+      }
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    const uint8x16_t first = vdupq_n_u8(lit->str[0]);
+    const uint8x16_t last = vdupq_n_u8(lit->str[n - 1]);
+    for (; t + 16 <= last_start + 1; t += 16) {
+      uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(t), first),
+                               vceqq_u8(vld1q_u8(t + n - 1), last));
+      /* narrow to 4 bits per byte since NEON has no movemask */
+      uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+      while (mask) {
+        int i = __builtin_ctzll(mask) >> 2;
+        if (memcmp(t + i + 1, lit->str + 1, n - 1) == 0) return (const char *)(t + i);
+        mask &= ~(0xFULL << (i << 2));
+      }
+    }
+  }
+#endif
+  /* scalar fallback, also the tail of the vectorized loops */
+  while (t <= last_start) {
+    t = memchr(t, lit->str[0], last_start - t + 1);
+    if (!t) return NULL;
+    if (memcmp(t + 1, lit->str + 1, n - 1) == 0) return (const char *)t;
+    t++;
+  }
+  return NULL;
+}
+
+/*
+ * first \n in text, NULL if none. 32 (AVX2) or 16 (SSE2, NEON) bytes are
+ * compared at once.
+ */
+static const char *
+scan_newline(const char *text, const char *text_end)
+{
+  const unsigned char *t = (const unsigned char *)text;
+  const unsigned char *end = (const unsigned char *)text_end;
+#if defined(__AVX2__)
+  {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; t + 32 <= end; t += 32) {
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)t), nl));
+      if (mask) return (const char *)(t + __builtin_ctz(mask));
+    }
+  }
+#elif defined(__SSE2__)
+  {
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; t + 16 <= end; t += 16) {
+      uint32_t mask = (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)t), nl));
+      if (mask) return (const char *)(t + __builtin_ctz(mask));
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    for (; t + 16 <= end; t += 16) {
+      uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(vceqq_u8(vld1q_u8(t), nl)), 4)), 0);
+      if (mask) return (const char *)(t + (__builtin_ctzll(mask) >> 2));
     }
-    p++;
+  }
+#endif
+  if (t >= end) return NULL;
+  return memchr(t, '\n', end - t);
+}
+
+/* next position a match can start at, NULL if none */
+static const char *
+next_start(const regex_t *preg, const char *text, const char *text_end)
+{
+  if (preg->lit && preg->lit->prefix) return scan_literal(text, text_end, preg->lit);
+  if (!preg->has_first) return text;
+  for (; text < text_end; text++) {
+    if (ccl_match(preg->first, (unsigned char)*text)) return text;
   }
   return NULL;
 }
 
-/*
- * report nsub
- */
+/*
+ * capture slots
+ * Every overwritten slot is logged in the trail. A matcher function that
+ * fails rolls the trail back to where it started, so the slots are left as
+ * they were and undoing costs as much as the changes made.
+ */
+static bool
+trail_grow(ReState *rs)
+{
+  const regex_t *preg = rs->preg;
+  ReTrail *trail = preg->alloc_fn(preg->alloc_ctx, sizeof(ReTrail) * rs->trail_capa * 2);
+  if (!trail) return false;
+  memcpy(trail, rs->trail, sizeof(ReTrail) * rs->trail_len);
+  if (rs->trail_capa > RE_TRAIL_INIT) preg->free_fn(preg->alloc_ctx, rs->trail);
+  rs->trail = trail;
+  rs->trail_capa *= 2;
+  return true;
+}
+
+static void
+set_slot(ReState *rs, int slot, regoff_t value)
+{
+  if (rs->trail_len == rs->trail_capa && !trail_grow(rs)) {
+    rs->nomem = true;
+    return;
+  }
+  rs->trail[rs->trail_len].slot = slot;
+  rs->trail[rs->trail_len].value = rs->caps[slot];
+  rs->trail_len++;
+  rs->caps[slot] = value;
+}
+
+static void
+set_caps(ReState *rs, int nsub, const char *text, regoff_t len)
+{
+  regoff_t so = text - rs->original_text_top_addr;
+  set_slot(rs, 2 * nsub, so);
+  set_slot(rs, 2 * nsub + 1, so + len);
+}
+
+static void
+undo_caps(ReState *rs, int mark)
+{
+  while (rs->trail_len > mark) {
+    rs->trail_len--;
+    rs->caps[rs->trail[rs->trail_len].slot] = rs->trail[rs->trail_len].value;
+  }
+}
+
+/*
+ * ^ and $ at text, which REG_NEWLINE lets match next to a line break as well
+ */
+static inline bool
+at_bol(ReState *rs, const char *text)
+{
+  return text == rs->original_text_top_addr ||
+         ((rs->preg->cflags & REG_NEWLINE) && text[-1] == '\n');
+}
+
+static inline bool
+at_eol(ReState *rs, const char *text)
+{
+  return text == rs->text_end || ((rs->preg->cflags & REG_NEWLINE) && text[0] == '\n');
+}
+
+/*
+ * matcher functions
+ */
+static int
+matchone(ReState *rs, const ReAtom *p, const char *text)
+{
+  if (text == rs->text_end) return -1;
+  if ((p->type == RE_TYPE_LIT && p->ch == (unsigned char)text[0]) || (p->type == RE_TYPE_DOT))
+    return 1;
+  if (p->type == RE_TYPE_BRACKET) return matchchars(rs, RE_CCL(p), text);
+  return -1;
+}
+
+/*
+ * repetitions allowed by the quantifier after p (an atom or the ) of a
+ * group), max 0 for no limit. Returns the atom following the quantifier.
+ */
+static const ReAtom *
+repeat_limits(const ReAtom *p, int *rmin, int *rmax)
+{
+  switch ((p + 1)->type) {
+  case RE_TYPE_QUESTION: *rmin = 0; *rmax = 1; return p + 2;
+  case RE_TYPE_STAR:     *rmin = 0; *rmax = 0; return p + 2;
+  case RE_TYPE_PLUS:     *rmin = 1; *rmax = 0; return p + 2;
+  case RE_TYPE_REPEAT:   *rmin = (p + 1)->repeat.min; *rmax = (p + 1)->repeat.max; return p + 2;
+  default:               *rmin = 1; *rmax = 1; return p + 1;
+  }
+}
+
+/*
+ * backtrack stack
+ * Doubled through alloc_fn when full, rs->nomem is set if it can't be.
+ */
+static ReFrame *
+push_frame(ReState *rs, ReFrameKind kind, const ReAtom *regexp, const char *text, const ReAtom *end, int mark)
+{
+  const regex_t *preg = rs->preg;
+  ReFrame *f;
+  if (rs->nframe == rs->frames_capa) {
+    ReFrame *frames = preg->alloc_fn(preg->alloc_ctx, sizeof(ReFrame) * rs->frames_capa * 2);
+    if (!frames) {
+      rs->nomem = true;
+      return NULL;
+    }
+    memcpy(frames, rs->frames, sizeof(ReFrame) * rs->nframe);
+    if (rs->frames_capa > RE_FRAMES_INIT) preg->free_fn(preg->alloc_ctx, rs->frames);
+    rs->frames = frames;
+    rs->frames_capa *= 2;
+  }
+  f = &rs->frames[rs->nframe++];
+  f->kind = kind;
+  f->regexp = regexp;
+  f->text = text;
+  f->end = end;
+  f->mark = mark;
+  f->prev = rs->group;
+  return f;
+}
+
+/* starts a repetition of the group at lparen, its content is matched next */
+static bool
+enter_group(ReState *rs, const ReAtom *lparen, const char *text, const ReAtom *end, int count)
+{
+  ReFrame *f = push_frame(rs, RE_FRAME_GROUP, lparen, text, end, rs->trail_len);
+  if (!f) return false;
+  f->count = count;
+  rs->group = rs->nframe - 1;
+  return true;
+}
+
+/*
+ * matchhere: search for regexp at beginning of text, returns where the match
+ * ends or NULL.
+ * It runs as a loop over (regexp, text, end), end being the ) of the group
+ * whose content is matched or NULL. The choices left to try are frames on
+ * rs->frames, so the C stack stays the same whatever the pattern and text.
+ * The choices inside a group stay after its content has matched, so a
+ * failure later on goes back into it as the Pike VM would. Those of an
+ * atomic group or a possessive one are dropped instead.
+ */
+static const char *
+matchhere(ReState *rs, const ReAtom *regexp, const char *text)
+{
+  const ReAtom *end = NULL, *after, *rparen;
+  const char *t;
+  ReFrame *f, g;
+  int rmin, rmax, i, mark = rs->trail_len;
+  bool possessive, cut;
+
+  rs->nframe = 0;
+  rs->group = -1;
+  for (;;) {
+    if (rs->steps == 0 || rs->nomem) break; // out of budget or memory, give up
+    rs->steps--;
+
+    if (at_end(regexp, end)) {
+      if (rs->group < 0) return text; // the whole pattern matched
+      /* one repetition of the innermost group matched */
+      g = rs->frames[rs->group];
+      rparen = find_rparen(g.regexp);
+      after = repeat_limits(rparen, &rmin, &rmax);
+      possessive = after != rparen + 1 && (rparen + 1)->repeat.possessive;
+      cut = !g.regexp->nsub || possessive;
+      if (cut) rs->nframe = rs->group; // the group frame goes too
+      rs->group = g.prev;
+      if (text == g.text && rmax == 0 && g.count >= rmin) {
+        /*
+         * an empty repetition of * (or past the minimum of + and {n,}) is
+         * dropped and ends the loop, as the Pike VM does
+         */
+        if (!cut) goto fail; // the group frame ends it
+        undo_caps(rs, g.mark);
+        regexp = after;
+        end = g.end;
+        continue;
+      }
+      if (g.regexp->nsub) set_caps(rs, g.regexp->nsub, g.text, text - g.text);
+      /*
+       * fewer repetitions are tried if the rest fails, from the group frame,
+       * or from a new one if it was cut and the group isn't possessive
+       */
+      if (cut && !possessive && g.count >= rmin &&
+          !push_frame(rs, RE_FRAME_RESUME, after, g.text, g.end, g.mark)) break;
+      /* after an empty repetition that counts, the next ones would be empty too */
+      if ((rmax && g.count + 1 >= rmax) || text == g.text) {
+        regexp = after;
+        end = g.end;
+        continue;
+      }
+      if (!enter_group(rs, g.regexp, text, g.end, g.count + 1)) break;
+      regexp = g.regexp + 1;
+      end = rparen;
+      continue;
+    }
+
+    switch ((regexp + 1)->type) {
+    case RE_TYPE_QUESTION:
+      if (matchone(rs, regexp, text) > 0) {
+        if (!(regexp + 1)->repeat.possessive &&
+            !push_frame(rs, RE_FRAME_RESUME, regexp + 2, text, end, rs->trail_len)) break;
+        text++;
+      }
+      regexp += 2;
+      continue;
+    case RE_TYPE_STAR:
+    case RE_TYPE_PLUS:
+    case RE_TYPE_REPEAT:
+      after = repeat_limits(regexp, &rmin, &rmax);
+      for (i = 0, t = text; i < rmin; i++, t++) {
+        if (matchone(rs, regexp, t) < 1) goto fail;
+      }
+      /* greedy, the shorter runs are tried from the frame */
+      for (; (rmax == 0 || t - text < rmax) && matchone(rs, regexp, t) > 0; t++);
+      if (t > text + rmin && !(regexp + 1)->repeat.possessive) {
+        f = push_frame(rs, RE_FRAME_STAR, after, text + rmin, end, rs->trail_len);
+        if (!f) break;
+        f->pos = t;
+      }
+      regexp = after;
+      text = t;
+      continue;
+    default:
+      break;
+    }
+    if (rs->nomem) break;
+
+    if (regexp->type == RE_TYPE_BEGIN || regexp->type == RE_TYPE_END) {
+      /* $ at the end, or ^ and $ in the middle like a$\n^b with REG_NEWLINE */
+      if (regexp->type == RE_TYPE_BEGIN ? at_bol(rs, text) : at_eol(rs, text)) {
+        regexp++;
+        continue;
+      }
+    } else if (regexp->type == RE_TYPE_LPAREN) {
+      rparen = find_rparen(regexp);
+      if (rparen) {
+        if (!enter_group(rs, regexp, text, end, 0)) break;
+        regexp++;
+        end = rparen;
+        continue;
+      }
+    } else if (matchone(rs, regexp, text) > 0) {
+      regexp++;
+      text++;
+      continue;
+    }
+
+  fail:
+    /* go on from the latest choice left */
+    for (;;) {
+      if (rs->nframe == 0) {
+        undo_caps(rs, mark);
+        return NULL;
+      }
+      f = &rs->frames[rs->nframe - 1];
+      undo_caps(rs, f->mark);
+      if (f->kind == RE_FRAME_STAR) {
+        /* one repetition less */
+        f->pos--;
+        regexp = f->regexp;
+        text = f->pos;
+        end = f->end;
+        rs->group = f->prev;
+        if (f->pos == f->text) rs->nframe--;
+        break;
+      }
+      rs->nframe--;
+      if (f->kind == RE_FRAME_RESUME) {
+        regexp = f->regexp;
+        text = f->text;
+        end = f->end;
+        rs->group = f->prev;
+        break;
+      }
+      /* RE_FRAME_GROUP: the content failed, the repetitions made so far may do */
+      rs->group = f->prev;
+      after = repeat_limits(find_rparen(f->regexp), &rmin, &rmax);
+      if (f->count >= rmin) {
+        regexp = after;
+        text = f->text;
+        end = f->end;
+        break;
+      }
+    }
+  }
+  undo_caps(rs, mark);
+  return NULL;
+}
+
+/*
+ * c is in the character class compiled by ccl_compile()
+ */
+static inline bool
+ccl_match(const unsigned char *set, unsigned char c)
+{
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+static int
+matchchars(ReState *rs, const unsigned char* set, const char *text)
+{
+  if (text == rs->text_end) return -1;
+  if (ccl_match(set, (unsigned char)text[0])) return 1;
+  return -1;
+}
+
+/*
+ * One-pass matcher for the patterns onepass_init() picks.
+ * Each atom takes its longest run and groups are recorded as they close,
+ * so nothing is ever tried twice. Returns where the match ends or NULL.
+ */
+static const char *
+onepass(ReState *rs, const ReAtom *regexp, const char *text)
+{
+  const ReAtom *p, *q, *next;
+  int n, rmin, rmax, mark = rs->trail_len;
+  for (p = regexp; p->type != RE_TYPE_TERM; p = next) {
+    if (rs->steps == 0) break;
+    rs->steps--;
+    next = p + 1;
+    if (p->type == RE_TYPE_LPAREN) {
+      if (p->nsub) set_slot(rs, 2 * p->nsub, text - rs->original_text_top_addr);
+      continue;
+    }
+    if (p->type == RE_TYPE_RPAREN) {
+      for (q = p - 1; q->type != RE_TYPE_LPAREN || q + q->span != p; q--);
+      if (q->nsub) set_slot(rs, 2 * q->nsub + 1, text - rs->original_text_top_addr);
+      continue;
+    }
+    if (p->type == RE_TYPE_BEGIN || p->type == RE_TYPE_END) {
+      if (!(p->type == RE_TYPE_BEGIN ? at_bol(rs, text) : at_eol(rs, text))) break;
+      continue;
+    }
+    next = repeat_limits(p, &rmin, &rmax);
+    for (n = 0; (rmax == 0 || n < rmax) && matchone(rs, p, text) > 0; n++) text++;
+    if (n < rmin) break;
+  }
+  if (p->type == RE_TYPE_TERM) return text;
+  undo_caps(rs, mark);
+  return NULL;
+}
+
+/* match from text, by the one-pass matcher when it can */
+static inline const char *
+match_at(ReState *rs, const ReAtom *regexp, const char *text)
+{
+  return rs->preg->onepass ? onepass(rs, regexp, text) : matchhere(rs, regexp, text);
+}
+
+static int
+match(ReState *rs, const ReAtom *regexp, const char *text)
+{
+  const char *e;
+  if (regexp->type == RE_TYPE_BEGIN) {
+    /* at the start of text, or of each line with REG_NEWLINE */
+    for (;;) {
+      if (at_bol(rs, text) && (e = match_at(rs, regexp + 1, text))) {
+        set_caps(rs, 0, text, e - text);
+        return rs->nomem ? -1 : 0;
+      }
+      if (!(rs->preg->cflags & REG_NEWLINE) || rs->steps == 0 || rs->nomem) return -1;
+      text = scan_newline(text, rs->text_end);
+      if (!text) return -1;
+      text++;
+    }
+  }
+  /* must look even if string is empty, next_start() skips nothing then */
+  for (text = next_start(rs->preg, text, rs->text_end); text;
+       text = next_start(rs->preg, text + 1, rs->text_end)) {
+    e = match_at(rs, regexp, text);
+    if (e) {
+      set_caps(rs, 0, text, e - text);
+      return rs->nomem ? -1 : 0;
+    }
+    if (text == rs->text_end || rs->steps == 0 || rs->nomem) return -1;
+  }
+  return -1;
+}
+
+/*
+ * trail and frames are the first RE_TRAIL_INIT and RE_FRAMES_INIT entries,
+ * longer ones are allocated
+ */
+static void
+state_init(ReState *rs, const regex_t *preg, const char *text, size_t len, regoff_t *caps, ReTrail *trail,
+           ReFrame *frames)
+{
+  rs->preg = preg;
+  rs->original_text_top_addr = text;
+  rs->text_end = text + len;
+  rs->caps = caps;
+  rs->nslot = 2 * (int)(preg->re_nsub + 1);
+  rs->trail = trail;
+  rs->trail_len = 0;
+  rs->trail_capa = RE_TRAIL_INIT;
+  rs->frames = frames;
+  rs->nframe = 0;
+  rs->frames_capa = RE_FRAMES_INIT;
+  rs->steps = SIZE_MAX;
+}
+
+/* frees the trail and frames allocated while matching */
+static void
+state_release(ReState *rs)
+{
+  const regex_t *preg = rs->preg;
+  if (rs->trail_capa > RE_TRAIL_INIT) preg->free_fn(preg->alloc_ctx, rs->trail);
+  if (rs->frames_capa > RE_FRAMES_INIT) preg->free_fn(preg->alloc_ctx, rs->frames);
+}
+
+/* state with its frames, trail and caps in one block, NULL if out of memory */
+static ReState *
+state_new(const regex_t *preg, const char *text, size_t len)
+{
+  /* state | frames | trail | caps */
+  size_t head = (sizeof(ReState) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  size_t frames = sizeof(ReFrame) * RE_FRAMES_INIT, trail = sizeof(ReTrail) * RE_TRAIL_INIT;
+  char *block = preg->alloc_fn(preg->alloc_ctx, head + frames + trail + sizeof(regoff_t) * 2 * (preg->re_nsub + 1));
+  if (!block) return NULL;
+  state_init((ReState *)block, preg, text, len, (regoff_t *)(block + head + frames + trail),
+             (ReTrail *)(block + head + frames), (ReFrame *)(block + head));
+  return (ReState *)block;
+}
+
+/* runs the backtracker from p, the slots of the match are left in rs->caps */
+static int
+backtrack(ReState *rs, const char *p)
+{
+  int i;
+  for (i = 0; i < rs->nslot; i++) rs->caps[i] = -1;
+  rs->trail_len = 0;
+  rs->nomem = false;
+  return match(rs, rs->preg->atoms, p);
+}
+
+static void
+set_match_data(ReState *rs, size_t nmatch, regmatch_t *pmatch)
+{
+  int i;
+  for (i = 0; i < nmatch; i++) {
+    (pmatch + i)->rm_so = (2 * i < rs->nslot) ? rs->caps[2 * i] : -1;
+    (pmatch + i)->rm_eo = (2 * i < rs->nslot) ? rs->caps[2 * i + 1] : -1;
+  }
+}
+
+/* backtracks from p with a budget of steps, SIZE_MAX for none */
+static int
+state_exec(ReState *rs, const char *p, size_t nmatch, regmatch_t *pmatch, size_t steps)
+{
+  rs->steps = steps;
+  if (backtrack(rs, p) == 0) {
+    set_match_data(rs, nmatch, pmatch);
+    return 0; /* success */
+  }
+  if (rs->nomem) return REG_ESPACE;
+  if (rs->steps == 0) return REG_ESTEPS;
+  return -1; /* to be correct, it should be a thing like REG_NOMATCH */
+}
+
+/*
+ * Pike VM
+ * Runs the NFA program over the text once, keeping capture slots per thread.
+ * Threads are ordered by priority, so the first thread reaching RE_OP_MATCH
+ * gives the same leftmost-greedy result as the backtracker, in O(prog * text).
+ */
+typedef struct re_thread_list {
+  int n;
+  uint16_t *pc;
+  regoff_t *caps; // nslot slots per thread
+} ReThreadList;
+
+typedef struct re_pike {
+  const ReProg *prog;
+  int nslot;
+  size_t *seen;   // position at which each pc has been added last
+  int look;       // byte at the position threads are added at, 256 at the end of text
+  int prev;       // byte before that position, 256 at the start of text
+  ReThreadList lists[2];
+  ReThreadList *clist, *nlist;
+  regoff_t *seed; // slots of a new thread
+  regoff_t *found; // slots of the best match so far
+  bool matched;
+  size_t steps;   // thread steps that may still be run
+  bool out_of_steps; // a position needed more steps than were left
+} RePike;
+
+static void
+pike_addthread(RePike *vm, ReThreadList *l, uint16_t pc, size_t sp, regoff_t *caps)
+{
+  const ReInst *ip;
+  regoff_t old;
+  if (vm->seen[pc] == sp) return;
+  vm->seen[pc] = sp;
+  ip = &vm->prog->inst[pc];
+  switch (ip->op) {
+    case RE_OP_JMP:
+      pike_addthread(vm, l, ip->x, sp, caps);
+      break;
+    case RE_OP_SPLIT:
+      pike_addthread(vm, l, ip->x, sp, caps);
+      pike_addthread(vm, l, ip->y, sp, caps);
+      break;
+    case RE_OP_ALT: {
+      /* only the branches which can start with the next byte, in order */
+      uint64_t mask = RE_ALT(ip)->first[vm->look];
+      while (mask) {
+        pike_addthread(vm, l, RE_ALT(ip)->pc[__builtin_ctzll(mask)], sp, caps);
+        mask &= mask - 1;
+      }
+      break;
+    }
+    case RE_OP_SAVE:
+      if (ip->n >= vm->nslot) {
+        pike_addthread(vm, l, pc + 1, sp, caps);
+        break;
+      }
+      old = caps[ip->n];
+      caps[ip->n] = (regoff_t)sp;
+      pike_addthread(vm, l, pc + 1, sp, caps);
+      caps[ip->n] = old;
+      break;
+    case RE_OP_BOL:
+      if (vm->prev == 256 || (vm->prog->newline && vm->prev == '\n'))
+        pike_addthread(vm, l, pc + 1, sp, caps);
+      break;
+    case RE_OP_EOL:
+      if (vm->look == 256 || (vm->prog->newline && vm->look == '\n'))
+        pike_addthread(vm, l, pc + 1, sp, caps);
+      break;
+    default:
+      l->pc[l->n] = pc;
+      memcpy(l->caps + l->n * vm->nslot, caps, sizeof(regoff_t) * vm->nslot);
+      l->n++;
+      break;
+  }
+}
+
+static bool
+pike_step(const ReInst *ip, unsigned char c)
+{
+  switch (ip->op) {
+    case RE_OP_CHAR:  return ip->ch == c;
+    case RE_OP_ANY:   return true;
+    case RE_OP_CLASS: return ccl_match(RE_CCL(ip), c);
+    default:          return false;
+  }
+}
+
+/* scratch bytes of the VM */
+static size_t
+pike_size(const ReProg *prog, int nslot)
+{
+  /* seen[len] | caps[len * nslot] x 2 | seed[nslot] | found[nslot] | pc[len] x 2 */
+  return sizeof(size_t) * prog->len
+       + sizeof(regoff_t) * (2 * prog->len * nslot + 2 * nslot)
+       + sizeof(uint16_t) * 2 * prog->len;
+}
+
+/* forgets all threads and the match, to search again from the start of text */
+static void
+pike_reset(RePike *vm)
+{
+  memset(vm->seen, 0xFF, sizeof(size_t) * vm->prog->len);
+  vm->prev = 256;
+  vm->lists[0].n = vm->lists[1].n = 0;
+  vm->clist = &vm->lists[0];
+  vm->nlist = &vm->lists[1];
+  vm->matched = false;
+  vm->out_of_steps = false;
+}
+
+static void
+pike_init(RePike *vm, const ReProg *prog, int nslot, char *scratch)
+{
+  vm->prog = prog;
+  vm->nslot = nslot;
+  vm->seen = (size_t *)scratch;
+  vm->lists[0].caps = (regoff_t *)(vm->seen + prog->len);
+  vm->lists[1].caps = vm->lists[0].caps + prog->len * nslot;
+  vm->seed = vm->lists[1].caps + prog->len * nslot;
+  vm->found = vm->seed + nslot;
+  vm->lists[0].pc = (uint16_t *)(vm->found + nslot);
+  vm->lists[1].pc = vm->lists[0].pc + prog->len;
+  vm->steps = SIZE_MAX;
+  pike_reset(vm);
+}
+
+/*
+ * runs the threads at sp over c (256 at the end of text), look is the byte after it.
+ * false if the search is over: the match can't get any better, or nothing can match.
+ */
+static bool
+pike_advance(RePike *vm, size_t sp, int c, int look)
+{
+  const ReProg *prog = vm->prog;
+  ReThreadList *tmp;
+  int i, nslot = vm->nslot;
+
+  /* a new thread starting here has lower priority than the running ones */
+  vm->look = c;
+  if (!vm->matched && (sp == 0 || !prog->anchored)) {
+    for (i = 0; i < nslot; i++) vm->seed[i] = -1;
+    pike_addthread(vm, vm->clist, 0, sp, vm->seed);
+  }
+  /* RE_OP_ALT may have added no thread where no branch can start */
+  if (vm->clist->n == 0 && (vm->matched || prog->anchored)) return false;
+  if ((size_t)vm->clist->n > vm->steps) {
+    vm->out_of_steps = true;
+    return false;
+  }
+  vm->steps -= vm->clist->n;
+  vm->nlist->n = 0;
+  vm->look = look;
+  vm->prev = c;
+  for (i = 0; i < vm->clist->n; i++) {
+    const ReInst *ip = &prog->inst[vm->clist->pc[i]];
+    regoff_t *caps = vm->clist->caps + i * nslot;
+    if (ip->op == RE_OP_MATCH) {
+      memcpy(vm->found, caps, sizeof(regoff_t) * nslot);
+      vm->matched = true;
+      break; // cut off the threads of lower priority
+    }
+    if (c < 256 && pike_step(ip, (unsigned char)c))
+      pike_addthread(vm, vm->nlist, vm->clist->pc[i] + 1, sp + 1, caps);
+  }
+  tmp = vm->clist;
+  vm->clist = vm->nlist;
+  vm->nlist = tmp;
+  return true;
+}
+
+/* searches text from start, the slots of the match are left in vm->found */
+static int
+pike_search(RePike *vm, const char *text, size_t len, size_t start)
+{
+  size_t sp;
+  vm->prev = start > 0 ? (unsigned char)text[start - 1] : 256;
+  for (sp = start;; sp++) {
+    int c = sp < len ? (unsigned char)text[sp] : 256;
+    int look = sp + 1 < len ? (unsigned char)text[sp + 1] : 256;
+    if (!pike_advance(vm, sp, c, look) || sp >= len) break;
+  }
+  return vm->matched ? 0 : -1;
+}
+
+/* VM and its scratch in one block, NULL if out of memory */
+static RePike *
+pike_new(const regex_t *preg, const ReProg *prog, int nslot)
+{
+  size_t head = (sizeof(RePike) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  char *block = preg->alloc_fn(preg->alloc_ctx, head + pike_size(prog, nslot));
+  if (!block) return NULL;
+  pike_init((RePike *)block, prog, nslot, block + head);
+  return (RePike *)block;
+}
+
+/* searches text from start with a VM made before. steps is the budget, SIZE_MAX for none */
+static int
+pike_run(RePike *vm, const char *text, size_t len, size_t start, size_t nmatch, regmatch_t *pmatch, size_t steps)
+{
+  int i, result, nslot = vm->nslot;
+
+  pike_reset(vm);
+  vm->steps = steps;
+  result = pike_search(vm, text, len, start);
+  if (vm->out_of_steps) {
+    result = REG_ESTEPS; // a match found so far may not be the final one
+  } else if (result == 0) {
+    for (i = 0; i < nmatch; i++) {
+      pmatch[i].rm_so = (2 * i < nslot) ? vm->found[2 * i] : -1;
+      pmatch[i].rm_eo = (2 * i < nslot) ? vm->found[2 * i + 1] : -1;
+    }
+  }
+  return result;
+}
+
+static int
+pike_exec(const regex_t *preg, const char *text, size_t len, size_t start, size_t nmatch, regmatch_t *pmatch,
+          size_t steps)
+{
+  int result, nslot = 2 * (int)(nmatch < preg->re_nsub + 1 ? nmatch : preg->re_nsub + 1);
+  RePike *vm = pike_new(preg, preg->prog, nslot);
+  if (!vm) return REG_ESPACE;
+  result = pike_run(vm, text, len, start, nmatch, pmatch, steps);
+  preg->free_fn(preg->alloc_ctx, vm);
+  return result;
+}
+
+/*
+ * Lazy DFA
+ * For REG_NOSUB, states are built from the NFA program on demand and cached,
+ * so that the text is scanned once with a table lookup per byte.
+ * The cache is thrown away when it gets full.
+ */
+#define DFA_STATE_PC(dfa, s) ((uint16_t *)((s)->next + (dfa)->prog->nclass))
+
+static void
+dfa_addpc(ReDfa *dfa, uint16_t pc, bool bol, bool eol)
+{
+  const ReInst *ip;
+  if (dfa->mark[pc] == dfa->gen) return;
+  dfa->mark[pc] = dfa->gen;
+  ip = &dfa->prog->inst[pc];
+  switch (ip->op) {
+    case RE_OP_JMP:
+      dfa_addpc(dfa, ip->x, bol, eol);
+      break;
+    case RE_OP_SPLIT:
+      dfa_addpc(dfa, ip->x, bol, eol);
+      dfa_addpc(dfa, ip->y, bol, eol);
+      break;
+    case RE_OP_ALT: {
+      /* the next byte isn't known yet */
+      int i;
+      for (i = 0; i < RE_ALT(ip)->nbranch; i++) dfa_addpc(dfa, RE_ALT(ip)->pc[i], bol, eol);
+      break;
+    }
+    case RE_OP_SAVE:
+      dfa_addpc(dfa, pc + 1, bol, eol);
+      break;
+    case RE_OP_BOL:
+      if (bol) dfa_addpc(dfa, pc + 1, bol, eol);
+      break;
+    case RE_OP_EOL:
+      if (eol) {
+        dfa_addpc(dfa, pc + 1, bol, eol);
+        break;
+      }
+      /* stays pending until the end of text */
+      dfa->set[dfa->nset++] = pc;
+      break;
+    default:
+      dfa->set[dfa->nset++] = pc;
+      break;
+  }
+}
+
+static int
+pc_compare(const void *a, const void *b)
+{
+  return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/* finds or makes the state for dfa->set. NULL if the cache is full */
+static ReDfaState *
+dfa_state(ReDfa *dfa, bool bol)
+{
+  const ReProg *prog = dfa->prog;
+  ReDfaState *s;
+  uint32_t hash = 2166136261u;
+  int i, j, n = dfa->nset;
+  uint16_t pc;
+  bool match = false, eol_match = false, pending = false;
+
+  /* sort to make the set canonical */
+  if (n > 16) {
+    qsort(dfa->set, n, sizeof(uint16_t), pc_compare);
+  } else {
+    for (i = 1; i < n; i++) {
+      pc = dfa->set[i];
+      for (j = i; j > 0 && dfa->set[j - 1] > pc; j--) dfa->set[j] = dfa->set[j - 1];
+      dfa->set[j] = pc;
+    }
+  }
+  /* bol only tells states apart when a $ is pending, see eol_match below */
+  for (i = 0; i < n; i++) pending |= prog->inst[dfa->set[i]].op == RE_OP_EOL;
+  bol = bol && pending;
+  for (i = 0; i < n; i++) hash = (hash ^ dfa->set[i]) * 16777619u;
+  for (s = dfa->states; s; s = s->link) {
+    if (s->hash == hash && s->npc == n && s->bol == bol &&
+        memcmp(DFA_STATE_PC(dfa, s), dfa->set, sizeof(uint16_t) * n) == 0)
+      return s;
+  }
+
+  size_t size = sizeof(ReDfaState) + sizeof(ReDfaState *) * prog->nclass + sizeof(uint16_t) * n;
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (dfa->cache_used + size > dfa->cache_size) return NULL;
+  s = (ReDfaState *)(dfa->cache + dfa->cache_used);
+  dfa->cache_used += size;
+
+  for (i = 0; i < n; i++) {
+    if (prog->inst[dfa->set[i]].op == RE_OP_MATCH) match = true;
+  }
+  /* see if the pending $ lead to a match; the closure is appended after set[n] */
+  dfa->gen++;
+  for (i = 0; i < n && !eol_match; i++) {
+    if (prog->inst[dfa->set[i]].op != RE_OP_EOL) continue;
+    dfa_addpc(dfa, dfa->set[i] + 1, bol, true);
+    for (j = n; j < dfa->nset; j++) {
+      if (prog->inst[dfa->set[j]].op == RE_OP_MATCH) eol_match = true;
+    }
+  }
+  dfa->nset = n;
+
+  s->link = dfa->states;
+  s->hash = hash;
+  s->npc = n;
+  s->match = match;
+  s->eol_match = match || eol_match;
+  s->reported = 0;
+  s->bol = bol;
+  memset(s->next, 0, sizeof(ReDfaState *) * prog->nclass);
+  memcpy(DFA_STATE_PC(dfa, s), dfa->set, sizeof(uint16_t) * n);
+  dfa->states = s;
+  return s;
+}
+
+/* drops every state */
 static void
-re_report_nsub(ReState *rs, const char *text)
+dfa_reset(ReDfa *dfa)
 {
-  int pos = (int)((long)text - (long)rs->original_text_top_addr);
-  int i;
-  int mask = (1 << rs->current_re_nsub) | 1;
-  for (i = 0; i < rs->nsub_stack_ptr; i++) {
+  dfa->states = NULL;
+  dfa->cache_used = 0;
+  dfa->start[0] = dfa->start[1] = NULL;
+}
 
+static ReDfaState *
+dfa_next(ReDfa *dfa, ReDfaState *s, unsigned char c)
+{
+  const ReProg *prog = dfa->prog;
+  uint16_t *pc = DFA_STATE_PC(dfa, s);
+  uint16_t *passed = dfa->set + prog->len;
+  ReDfaState *ns;
+  int i, npassed = 0;
+  bool bol = prog->newline && c == '\n';
+
+  if (bol) {
+    /* pending $ pass before a line break: what follows them runs over it too */
+    dfa->gen++;
+    dfa->nset = 0;
+    for (i = 0; i < s->npc; i++) {
+      if (prog->inst[pc[i]].op == RE_OP_EOL) dfa_addpc(dfa, pc[i] + 1, s->bol, true);
+    }
+    npassed = dfa->nset;
+    memcpy(passed, dfa->set, sizeof(uint16_t) * npassed);
+  }
+  dfa->gen++;
+  dfa->nset = 0;
+  for (i = 0; i < s->npc; i++) {
+    if (pike_step(&prog->inst[pc[i]], c)) dfa_addpc(dfa, pc[i] + 1, bol, false);
+  }
+  for (i = 0; i < npassed; i++) {
+    if (pike_step(&prog->inst[passed[i]], c)) dfa_addpc(dfa, passed[i] + 1, bol, false);
+  }
+  dfa_addpc(dfa, 0, bol, false); // a match can also start at the next position
+  ns = dfa_state(dfa, bol);
+  if (ns) {
+    s->next[prog->byteclass[c]] = ns;
+    return ns;
+  }
+  /* reset the cache. s is gone but the new set is still there */
+  dfa_reset(dfa);
+  return dfa_state(dfa, bol);
+}
 
+/* bytes of mark[len] | set[2 * len] in front of the cache */
+static size_t
+dfa_scratch_size(const ReProg *prog)
+{
+  size_t size = sizeof(uint32_t) * prog->len + sizeof(uint16_t) * 2 * prog->len;
+  return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
 
-    mask |= (1 << rs->nsub_stack[i]);
-  }
-  rs->match_index_data[pos] = mask;
+static void
+dfa_init(ReDfa *dfa, const ReProg *prog, char *block, size_t cache_size)
+{
+  size_t scratch = dfa_scratch_size(prog);
+  dfa->prog = prog;
+  dfa->mark = (uint32_t *)block;
+  memset(dfa->mark, 0, sizeof(uint32_t) * prog->len);
+  dfa->gen = 1;
+  dfa->run = 0;
+  dfa->set = (uint16_t *)(dfa->mark + prog->len);
+  dfa->nset = 0;
+  dfa->cache = block + scratch;
+  dfa->cache_size = cache_size;
+  dfa_reset(dfa);
 }
-#define REPORT_WITHOUT_RETURN (re_report_nsub(rs, text))
-#define REPORT \
-  do { \
-    re_report_nsub(rs, text); \
-    return 1; \
-  } while (0)
+
 /*
- * matcher functions
+ * state a run of the DFA starts in, kept until the cache is reset.
+ * NULL if the cache can't hold one state.
  */
-static int
-matchone(ReState *rs, ReAtom *p, const char *text)
+static ReDfaState *
+dfa_start(ReDfa *dfa, bool bol)
 {
-  if (text[0] == '\0') return -1;
-  if ((p->type == RE_TYPE_LIT && p->ch == text[0]) || (p->type == RE_TYPE_DOT))
-    REPORT;
-  if (p->type == RE_TYPE_BRACKET) return matchchars(rs, p->ccl, text);
-  return -1;
+  ReDfaState *s;
+  /* the generations can't wrap around while this text is run */
+  if (dfa->gen > UINT32_MAX / 2) {
+    memset(dfa->mark, 0, sizeof(uint32_t) * dfa->prog->len);
+    dfa->gen = 1;
+  }
+  if (dfa->start[bol]) return dfa->start[bol];
+  dfa->gen++; // the marks of the previous run don't count
+  dfa->nset = 0;
+  dfa_addpc(dfa, 0, bol, false);
+  s = dfa_state(dfa, bol);
+  if (!s) {
+    /* the states of the previous runs fill the cache */
+    dfa_reset(dfa);
+    s = dfa_state(dfa, bol);
+  }
+  return dfa->start[bol] = s;
 }
 
+/*
+ * runs a DFA made before, whose states are kept from the earlier runs.
+ * vm is the Pike VM to fall back on if the cache can't hold one state,
+ * NULL to make one. steps is the budget of bytes, SIZE_MAX for none.
+ */
 static int
-match_group_content_once(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start)
-{
-  int len;
-  // Save state
-  size_t text_len = strlen(rs->original_text_top_addr);
-  int saved_mid[text_len];
-  memcpy(saved_mid, rs->match_index_data, sizeof(int) * text_len);
-
-  int saved_nsub_stack_ptr = rs->nsub_stack_ptr;
-  int saved_current_re_nsub = rs->current_re_nsub;
-  int saved_max_re_nsub = rs->max_re_nsub;
-
-  // Push group state
-  if (rs->nsub_stack_ptr >= 10) return -1;
-  rs->nsub_stack[rs->nsub_stack_ptr++] = rs->current_re_nsub;
-  rs->max_re_nsub++;
-  rs->current_re_nsub = rs->max_re_nsub;
-
-  // Temporarily terminate the group
-  ReType old_type = rparen->type;
-  rparen->type = RE_TYPE_TERM;
-
-  len = matchhere(rs, lparen + 1, text, start);
-
-  rparen->type = old_type; // Restore rparen type
-
-  if (len < 0) {
-    // Restore state on failure
-    rs->nsub_stack_ptr = saved_nsub_stack_ptr;
-    rs->current_re_nsub = saved_current_re_nsub;
-    rs->max_re_nsub = saved_max_re_nsub;
-    memcpy(rs->match_index_data, saved_mid, sizeof(int) * text_len);
+dfa_run(const regex_t *preg, ReDfa *dfa, RePike *vm, const char *text, size_t len, size_t start, size_t steps)
+{
+  const ReProg *prog = preg->prog;
+  ReDfaState *s, *ns;
+  const char *p, *nl, *text_end = text + len;
+  bool bol = start == 0 || (prog->newline && text[start - 1] == '\n');
+
+  s = dfa_start(dfa, bol);
+  for (p = text + start; s; p++) {
+    if (s->match || p == text_end) break;
+    if (s->npc == 0) {
+      /* nothing can match until ^ at the next line */
+      if (!prog->newline || !(nl = scan_newline(p, text_end))) break;
+      p = nl;
+    }
+    if (prog->newline && *p == '\n' && s->eol_match) break; // $ before a line break
+    if (steps == 0) return REG_ESTEPS; // text is left but the budget is not
+    steps--;
+    ns = s->next[prog->byteclass[(unsigned char)*p]];
+    s = ns ? ns : dfa_next(dfa, s, (unsigned char)*p);
+  }
+  if (s) {
+    if (s->match || ((p == text_end || (prog->newline && *p == '\n')) && s->eol_match)) return 0;
     return -1;
   }
+  /* the cache can't hold even one state */
+  if (vm) return pike_run(vm, text, len, start, 0, NULL, steps);
+  return pike_exec(preg, text, len, start, 0, NULL, steps);
+}
 
-  // Pop group state
-  rs->nsub_stack_ptr--;
-  rs->current_re_nsub = rs->nsub_stack[rs->nsub_stack_ptr];
-
-  return len;
+/* DFA of prog and its scratch and cache in one block, NULL if out of memory */
+static ReDfa *
+dfa_new(const regex_t *preg, const ReProg *prog)
+{
+  size_t head = (sizeof(ReDfa) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  char *block = preg->alloc_fn(preg->alloc_ctx, head + dfa_scratch_size(prog) + preg->dfa_cache_size);
+  if (!block) return NULL;
+  dfa_init((ReDfa *)block, prog, block + head, preg->dfa_cache_size);
+  return (ReDfa *)block;
 }
 
 static int
-matchquestion(ReState *rs, ReAtom *regexp, const char *text, ReAtom *start)
+dfa_exec(const regex_t *preg, const char *text, size_t len, size_t start, size_t steps)
 {
-  int len1, len2;
-  // Path 1 (greedy): match one and rest
-  len1 = matchone(rs, regexp, text);
-  if (len1 > 0) {
-    len2 = matchhere(rs, regexp + 2, text + len1, start);
-    if (len2 >= 0) return len1 + len2;
-  }
-  // Path 2: match zero and rest
-  return matchhere(rs, regexp + 2, text, start);
+  int result;
+  ReDfa *dfa = dfa_new(preg, preg->prog);
+  if (!dfa) return pike_exec(preg, text, len, start, 0, NULL, steps);
+  result = dfa_run(preg, dfa, NULL, text, len, start, steps);
+  preg->free_fn(preg->alloc_ctx, dfa);
+  return result;
 }
 
+/*
+ * Reverse search of a pattern ending with $
+ * The reversed program (see rprog_new()) is run by a DFA from the end of
+ * text backward until no state is left, so that it reads only as far back
+ * as a match can reach. *start is moved up to the leftmost position a match
+ * can start at, which is where the forward search begins.
+ * -1 if no match can end at the end of text, RE_UNKNOWN if it gave up
+ * (out of memory, or a cache too small for a state) and the forward
+ * search has to answer alone. dfa is NULL to make one.
+ */
+#define RE_UNKNOWN 1
+
 static int
-match_group_question(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start)
+reverse_start(const regex_t *preg, ReDfa *dfa, const char *text, size_t len, const char **start, size_t *steps)
 {
-  int len1, len2;
-  size_t text_len = strlen(rs->original_text_top_addr);
-  int saved_mid[text_len];
-  memcpy(saved_mid, rs->match_index_data, sizeof(int) * text_len);
+  const ReProg *prog = preg->rprog;
+  ReDfaState *s, *ns;
+  const char *p = text + len, *found = NULL;
+  ReDfa *own = dfa ? NULL : dfa_new(preg, prog);
+
+  if (!dfa && !(dfa = own)) return RE_UNKNOWN;
+  if (dfa->gen > UINT32_MAX / 2) {
+    memset(dfa->mark, 0, sizeof(uint32_t) * prog->len);
+    dfa->gen = 1;
+  }
+  dfa->gen++;
+  dfa->nset = 0;
+  dfa_addpc(dfa, 0, true, false);
+  s = dfa_state(dfa, true);
+  while (s) {
+    if (s->match) found = p;
+    if (p == *start || s->npc == 0 || *steps == 0) break;
+    (*steps)--;
+    p--;
+    ns = s->next[prog->byteclass[(unsigned char)*p]];
+    s = ns ? ns : dfa_next(dfa, s, (unsigned char)*p);
+  }
+  /* a ^ of the pattern, pending at the start of text */
+  if (s && p == text && s->eol_match) found = text;
+  if (own) preg->free_fn(preg->alloc_ctx, own);
+  if (!s) return RE_UNKNOWN; // the cache can't hold a state
+  if (*steps == 0 && p != *start && s->npc > 0) return REG_ESTEPS;
+  if (!found) return -1;
+  *start = found;
+  return 0;
+}
 
-  // Path 1 (greedy): match group and rest
-  ReType old_type = rparen->type;
-  rparen->type = RE_TYPE_TERM;
-  len1 = matchhere(rs, lparen + 1, text, start);
-  rparen->type = old_type;
+/*
+ * sets the bits of the pattern ids whose RE_OP_MATCH is in s, or reached
+ * through a pending $ if eol. Returns how many bits are newly set.
+ */
+static size_t
+dfa_report(ReDfa *dfa, const ReDfaState *s, bool bol, bool eol, uint32_t *matched)
+{
+  const ReProg *prog = dfa->prog;
+  const uint16_t *pc = DFA_STATE_PC(dfa, s);
+  const ReInst *ip;
+  size_t n = 0;
+  int i;
 
-  if (len1 >= 0) {
-    len2 = matchhere(rs, rparen + 2, text + len1, start);
-    if (len2 >= 0) return len1 + len2;
+  dfa->gen++;
+  dfa->nset = 0;
+  for (i = 0; i < s->npc; i++) {
+    ip = &prog->inst[pc[i]];
+    if (ip->op == RE_OP_MATCH) {
+      dfa->set[dfa->nset++] = pc[i];
+    } else if (eol && ip->op == RE_OP_EOL) {
+      dfa_addpc(dfa, pc[i] + 1, bol, true);
+    }
   }
-
-  // Path 2: match zero and rest
-  memcpy(rs->match_index_data, saved_mid, sizeof(int) * text_len);
-  return matchhere(rs, rparen + 2, text, start);
+  for (i = 0; i < dfa->nset; i++) {
+    ip = &prog->inst[dfa->set[i]];
+    if (ip->op != RE_OP_MATCH || (matched[ip->n >> 5] & (1u << (ip->n & 31)))) continue;
+    matched[ip->n >> 5] |= 1u << (ip->n & 31);
+    n++;
+  }
+  return n;
 }
 
-static int
-match_group_star(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start)
+/*
+ * public functions
+ */
+int
+regexec(const regex_t *preg, const char *text, size_t nmatch, regmatch_t *pmatch, int eflags)
 {
-  int len_g, len_b;
-  size_t text_len = strlen(rs->original_text_top_addr);
-
-  // Path 1 (greedy): Match G once, then recurse
-  // Save state before trying G
-  int saved_mid[text_len];
-  memcpy(saved_mid, rs->match_index_data, sizeof(int) * text_len);
-  int saved_nsub_stack_ptr = rs->nsub_stack_ptr;
-  int saved_current_re_nsub = rs->current_re_nsub;
-  int saved_max_re_nsub = rs->max_re_nsub;
+  return regnexec(preg, text, strlen(text), nmatch, pmatch, eflags);
+}
 
-  len_g = match_group_content_once(rs, lparen, rparen, text, start);
-  if (len_g > 0) {
-    len_b = match_group_star(rs, lparen, rparen, text + len_g, start);
-    if (len_b >= 0) return len_g + len_b;
+/*
+ * where the search has to start: the first place the required literal is
+ * found. NULL if it isn't in text. text may be past the start of the text
+ * when a match can't start before it.
+ */
+static const char *
+prefilter(const regex_t *preg, const char *text, size_t len)
+{
+  const char *p = text;
+  if (preg->lit) {
+    if (preg->lit->prefix && preg->atoms->type == RE_TYPE_BEGIN && !(preg->cflags & REG_NEWLINE)) {
+      if (len < preg->lit->len || memcmp(text, preg->lit->str, preg->lit->len) != 0) return NULL;
+    } else {
+      p = scan_literal(text, text + len, preg->lit);
+      if (!p) return NULL;
+      if (!preg->lit->prefix) p = text;
+    }
   }
+  return p;
+}
 
-  // If Path 1 failed, restore state and try Path 2
-  rs->nsub_stack_ptr = saved_nsub_stack_ptr;
-  rs->current_re_nsub = saved_current_re_nsub;
-  rs->max_re_nsub = saved_max_re_nsub;
-  memcpy(rs->match_index_data, saved_mid, sizeof(int) * text_len);
+/*
+ * text doesn't have to be NUL-terminated
+ */
+int
+regnexec(const regex_t *preg, const char *text, size_t len, size_t nmatch, regmatch_t *pmatch, int eflags)
+{
+  return regnexec_limit(preg, text, len, nmatch, pmatch, eflags, 0);
+}
 
-  // Path 2: Match B (0 G's)
-  return matchhere(rs, rparen + 2, text, start);
+/*
+ * regnexec() giving up after max_steps steps (0 for no limit) with
+ * REG_ESTEPS. A step is an atom tried by the backtracker, a thread run over
+ * a byte by the Pike VM, or a byte read by the lazy DFA.
+ */
+int
+regnexec_limit(const regex_t *preg, const char *text, size_t len, size_t nmatch, regmatch_t *pmatch, int _eflags,
+               size_t max_steps)
+{
+  const char *p = text;
+  size_t steps = max_steps ? max_steps : SIZE_MAX;
+  int result;
+  if (preg->rprog && preg->dfa_cache_size > 0) {
+    result = reverse_start(preg, NULL, text, len, &p, &steps);
+    /* the DFA would only say there is a match */
+    if (result != RE_UNKNOWN &&
+        (result != 0 || (preg->prog && ((preg->cflags & REG_NOSUB) || nmatch == 0)))) return result;
+  }
+  p = prefilter(preg, p, len - (p - text));
+  if (!p) return -1;
+  if (preg->prog) {
+    if (((preg->cflags & REG_NOSUB) || nmatch == 0) && preg->dfa_cache_size > 0)
+      return dfa_exec(preg, text, len, p - text, steps);
+    return pike_exec(preg, text, len, p - text, nmatch, pmatch, steps);
+  }
+  ReState rs;
+  ReTrail trail[RE_TRAIL_INIT];
+  ReFrame frames[RE_FRAMES_INIT];
+  regoff_t caps_buf[RE_CAPS_INIT], *caps = caps_buf;
+  int nslot = 2 * (int)(preg->re_nsub + 1);
+  if (nslot > RE_CAPS_INIT) {
+    caps = preg->alloc_fn(preg->alloc_ctx, sizeof(regoff_t) * nslot);
+    if (!caps) return REG_ESPACE;
+  }
+  state_init(&rs, preg, text, len, caps, trail, frames);
+  result = state_exec(&rs, p, nmatch, pmatch, steps);
+  state_release(&rs);
+  if (caps != caps_buf) preg->free_fn(preg->alloc_ctx, caps);
+  return result;
 }
 
-static int
-match_group_plus(ReState *rs, ReAtom *lparen, ReAtom *rparen, const char *text, ReAtom *start)
+/*
+ * scratch space for matching preg, taken once through its alloc_fn.
+ * regctx_exec() then matches with no allocation, the lazy DFA keeping the
+ * states it has built from one call to the next.
+ */
+int
+regctx_init(regctx_t *ctx, const regex_t *preg)
 {
-  int len_g, len_b;
-  size_t text_len = strlen(rs->original_text_top_addr);
+  bool ok;
+  ctx->preg = preg;
+  ctx->vm = NULL;
+  ctx->dfa = NULL;
+  ctx->rdfa = NULL;
+  ctx->rs = NULL;
+  ctx->max_steps = 0;
+  if (preg->prog) {
+    ctx->vm = pike_new(preg, preg->prog, 2 * (int)(preg->re_nsub + 1));
+    if (ctx->vm && preg->dfa_cache_size > 0) ctx->dfa = dfa_new(preg, preg->prog);
+    ok = ctx->vm && (preg->dfa_cache_size == 0 || ctx->dfa);
+  } else {
+    ctx->rs = state_new(preg, NULL, 0);
+    ok = ctx->rs != NULL;
+  }
+  if (ok && preg->rprog && preg->dfa_cache_size > 0) {
+    ctx->rdfa = dfa_new(preg, preg->rprog);
+    ok = ctx->rdfa != NULL;
+  }
+  if (!ok) {
+    regctx_free(ctx);
+    return -1;
+  }
+  return 0;
+}
 
-  // Path 1: Match G once
-  // Save state before trying G
-  int saved_mid[text_len];
-  memcpy(saved_mid, rs->match_index_data, sizeof(int) * text_len);
-  int saved_nsub_stack_ptr = rs->nsub_stack_ptr;
-  int saved_current_re_nsub = rs->current_re_nsub;
-  int saved_max_re_nsub = rs->max_re_nsub;
+/* regnexec_limit() with ctx->max_steps, on the scratch space of ctx */
+int
+regctx_exec(regctx_t *ctx, const char *text, size_t len, size_t nmatch, regmatch_t *pmatch, int _eflags)
+{
+  const regex_t *preg = ctx->preg;
+  const char *p = text;
+  size_t steps = ctx->max_steps ? ctx->max_steps : SIZE_MAX;
+  int result;
+  if (ctx->rdfa) {
+    result = reverse_start(preg, ctx->rdfa, text, len, &p, &steps);
+    if (result != RE_UNKNOWN &&
+        (result != 0 || (ctx->dfa && ((preg->cflags & REG_NOSUB) || nmatch == 0)))) return result;
+  }
+  p = prefilter(preg, p, len - (p - text));
+  if (!p) return -1;
+  if (ctx->dfa && ((preg->cflags & REG_NOSUB) || nmatch == 0))
+    return dfa_run(preg, ctx->dfa, ctx->vm, text, len, p - text, steps);
+  if (ctx->vm) return pike_run(ctx->vm, text, len, p - text, nmatch, pmatch, steps);
+  ctx->rs->original_text_top_addr = text;
+  ctx->rs->text_end = text + len;
+  return state_exec(ctx->rs, p, nmatch, pmatch, steps);
+}
 
-  len_g = match_group_content_once(rs, lparen, rparen, text, start);
-  if (len_g > 0) {
-    // If G matched, try to match (G)*B from the new position
-    len_b = match_group_star(rs, lparen, rparen, text + len_g, start);
-    if (len_b >= 0) return len_g + len_b;
+void
+regctx_free(regctx_t *ctx)
+{
+  const regex_t *preg = ctx->preg;
+  if (ctx->rs) {
+    state_release(ctx->rs);
+    preg->free_fn(preg->alloc_ctx, ctx->rs);
   }
+  if (ctx->dfa) preg->free_fn(preg->alloc_ctx, ctx->dfa);
+  if (ctx->rdfa) preg->free_fn(preg->alloc_ctx, ctx->rdfa);
+  if (ctx->vm) preg->free_fn(preg->alloc_ctx, ctx->vm);
+  ctx->rs = NULL;
+  ctx->dfa = NULL;
+  ctx->rdfa = NULL;
+  ctx->vm = NULL;
+}
 
-  // If G didn't match, or (G)*B failed, restore state and return failure
-  rs->nsub_stack_ptr = saved_nsub_stack_ptr;
-  rs->current_re_nsub = saved_current_re_nsub;
-  rs->max_re_nsub = saved_max_re_nsub;
-  memcpy(rs->match_index_data, saved_mid, sizeof(int) * text_len);
+#define REGEX_DEF_w "a-zA-Z0-9_"
+#define REGEX_DEF_s " \t\f\r\n"
+#define REGEX_DEF_d "0-9"
+#define RE_CCL_SIZE 32 // bytes of a 256-bit set
 
-  return -1;
+static void
+ccl_add(unsigned char *set, unsigned char from, unsigned char to)
+{
+  int c;
+  for (c = from; c <= to; c++) set[c >> 3] |= 1 << (c & 7);
 }
 
-/* matchhere: search for regexp at beginning of text */
-static int
-matchhere(ReState *rs, ReAtom *regexp, const char *text, ReAtom *start)
-{
-  int len;
-  if (regexp->type == RE_TYPE_TERM) return 0;
-
-  if ((regexp + 1)->type == RE_TYPE_QUESTION)
-    return matchquestion(rs, regexp, text, start);
-  if ((regexp + 1)->type == RE_TYPE_STAR)
-    return matchstar(rs, regexp, (regexp + 2), text, start);
-  if ((regexp + 1)->type == RE_TYPE_PLUS) {
-    int len1 = matchone(rs, regexp, text);
-    if (len1 < 0) return -1;
-    int len2 = matchstar(rs, regexp, (regexp + 2), text + len1, start);
-    if (len2 < 0) return -1;
-    return len1 + len2;
-  }
-  if ((regexp + 1)->type == RE_TYPE_REPEAT)
-    return matchrepeat(rs, regexp, regexp + 1, text, start);
-
-  if (regexp->type == RE_TYPE_END && (regexp + 1)->type == RE_TYPE_TERM)
-    return text[0] == '\0' ? 0 : -1;
-
-  if (regexp->type == RE_TYPE_LPAREN) {
-    ReAtom *rparen = find_rparen(regexp);
-    if (rparen) {
-      if ((rparen + 1)->type == RE_TYPE_QUESTION)
-        return match_group_question(rs, regexp, rparen, text, start);
-      if ((rparen + 1)->type == RE_TYPE_STAR)
-        return match_group_star(rs, regexp, rparen, text, start);
-      if ((rparen + 1)->type == RE_TYPE_PLUS)
-        return match_group_plus(rs, regexp, rparen, text, start);
-      if ((rparen + 1)->type == RE_TYPE_REPEAT)
-        return match_group_repeat(rs, regexp, rparen, rparen + 1, text, start);
-    }
-    int len, len2;
-    if (rs->nsub_stack_ptr >= 10) return -1;
-    rs->nsub_stack[rs->nsub_stack_ptr++] = rs->current_re_nsub;
-    rs->max_re_nsub++;
-    rs->current_re_nsub = rs->max_re_nsub;
-
-    if (!rparen) return -1;
-
-    ReType old_type = rparen->type;
-    rparen->type = RE_TYPE_TERM;
-
-    len = matchhere(rs, regexp + 1, text, start);
-
-    rparen->type = old_type;
-
-    if (len < 0) {
-      rs->max_re_nsub--;
-      rs->nsub_stack_ptr--;
-      rs->current_re_nsub = rs->nsub_stack[rs->nsub_stack_ptr];
-      return -1;
+/*
+ * compile the content of [ ] into a 256-bit set
+ * [^...] is the complement. \w \s \d and their negations \W \S \D
+ * can be used inside, any other escaped character is a literal.
+ */
+static void
+ccl_compile(unsigned char *set, const char *s, size_t len)
+{
+  const char *end = s + len;
+  unsigned char sub[RE_CCL_SIZE];
+  bool negate = false;
+  int i;
+  memset(set, 0, RE_CCL_SIZE);
+  if (len > 1 && s[0] == '^') {
+    negate = true;
+    s++;
+  }
+  while (s < end) {
+    if (s[0] == '\\' && s + 1 < end) {
+      const char *def = NULL;
+      switch (s[1]) {
+        case 'w': case 'W': def = REGEX_DEF_w; break;
+        case 's': case 'S': def = REGEX_DEF_s; break;
+        case 'd': case 'D': def = REGEX_DEF_d; break;
+      }
+      if (def) {
+        bool upper = (s[1] < 'a'); // \W \S \D
+        ccl_compile(sub, def, strlen(def));
+        for (i = 0; i < RE_CCL_SIZE; i++) set[i] |= upper ? ~sub[i] : sub[i];
+      } else {
+        ccl_add(set, s[1], s[1]);
+      }
+      s += 2;
+    } else if (s + 2 < end && s[1] == '-') {
+      ccl_add(set, s[0], s[2]); // a-z
+      s += 3;
+    } else {
+      ccl_add(set, s[0], s[0]); // including - at either end like [-a] or [a-]
+      s++;
     }
+  }
+  if (negate) {
+    for (i = 0; i < RE_CCL_SIZE; i++) set[i] = ~set[i];
+  }
+}
 
-    rs->nsub_stack_ptr--;
-    rs->current_re_nsub = rs->nsub_stack[rs->nsub_stack_ptr];
-
-    len2 = matchhere(rs, rparen + 1, text + len, start);
-    if (len2 < 0) return -1;
+/*
+ * REG_ICASE: a letter is put in set if either of its cases is there,
+ * or for [^...] only if neither of them was left out
+ */
+static void
+ccl_fold(unsigned char *set, bool negated)
+{
+  int c;
+  for (c = 'A'; c <= 'Z'; c++) {
+    bool upper = ccl_match(set, c), lower = ccl_match(set, c + 'a' - 'A');
+    if (negated ? upper && lower : upper || lower) {
+      ccl_add(set, c, c);
+      ccl_add(set, c + 'a' - 'A', c + 'a' - 'A');
+    } else {
+      set[c >> 3] &= ~(1 << (c & 7));
+      set[(c + 'a' - 'A') >> 3] &= ~(1 << ((c + 'a' - 'A') & 7));
+    }
+  }
+}
 
-    return len + len2;
+size_t
+gen_ccl(ReAtom *atom, unsigned char **ccl, const char *snippet, size_t len, bool dry_run)
+{
+  if (len == 0) len = strlen(snippet);
+  if (!dry_run) {
+    ccl_compile(*ccl, snippet, len);
+    atom->ccl = (int32_t)(*ccl - (unsigned char *)atom);
+    atom->type = RE_TYPE_BRACKET;
+    *ccl += RE_CCL_SIZE;
   }
+  return RE_CCL_SIZE;
+}
+#define gen_ccl_const(atom, ccl, snippet, dry_run) gen_ccl(atom, ccl, snippet, 0, dry_run)
 
-  if (text[0] != '\0') {
-    len = matchone(rs, regexp, text);
-    if (len > 0) {
-      int next_len = matchhere(rs, regexp + 1, text + len, start);
-      if (next_len >= 0) {
-        return len + next_len;
-      }
+/* offset from the ( at p to its matching ), 0 if none */
+static uint32_t
+paren_span(const ReAtom *p)
+{
+  const ReAtom *q;
+  int level;
+  for (q = p + 1, level = 1; q->type != RE_TYPE_TERM; q++) {
+    if (q->type == RE_TYPE_LPAREN) {
+      level++;
+    } else if (q->type == RE_TYPE_RPAREN && --level == 0) {
+      return (uint32_t)(q - p);
     }
   }
-  return -1;
+  return 0;
+}
+
+/*
+ * number each ( and store the offset to the matching )
+ * so that matching never has to look for it
+ */
+static void
+link_parens(ReAtom *atoms)
+{
+  ReAtom *p;
+  for (p = atoms; p->type != RE_TYPE_TERM; p++) {
+    if (p->type == RE_TYPE_LPAREN) p->span = paren_span(p);
+  }
+}
+
+/*
+ * compile atoms into the NFA program for the Pike VM
+ * Like regcomp(), it runs twice: counting instructions while inst is NULL,
+ * then emitting them.
+ */
+typedef struct re_compiler {
+  ReAtom *atoms;
+  const regex_t *pats; // patterns of a regset_t, NULL for a single pattern
+  size_t npat;
+  ReInst *inst;   // NULL on dry run
+  int pc;
+  ReAlt *alt;     // dispatch tables, NULL on dry run
+  int nalt;
+  unsigned char *ccl; // sets of RE_OP_CLASS, copied from the atoms. NULL on dry run
+  int nccl;
+} ReCompiler;
+
+static bool prog_compile_alt(ReCompiler *c, ReAtom *p, ReAtom *end);
+
+static bool
+is_quantifier(ReAtom *p)
+{
+  return p->type == RE_TYPE_QUESTION || p->type == RE_TYPE_STAR ||
+         p->type == RE_TYPE_PLUS || p->type == RE_TYPE_REPEAT;
 }
 
 static int
-matchstar(ReState *rs, ReAtom *c, ReAtom *regexp, const char *text, ReAtom *start)
+prog_emit(ReCompiler *c, ReOp op)
 {
-  const char *t;
-  int len;
+  if (c->inst) c->inst[c->pc].op = op;
+  return c->pc++;
+}
 
-  for (t = text; *t != '\0' && matchone(rs, c, t) > 0; t++)
-    ;
+static void
+prog_patch(ReCompiler *c, int pc, int x, int y)
+{
+  if (!c->inst) return;
+  c->inst[pc].x = x;
+  c->inst[pc].y = y;
+}
 
-  for (;; t--) {
-    len = matchhere(rs, regexp, t, start);
-    if (len >= 0) {
-      return (t - text) + len;
-    }
-    if (t == text) break;
+/* a single atom, or a group when rparen is given */
+static bool
+prog_compile_item(ReCompiler *c, ReAtom *p, ReAtom *rparen)
+{
+  int pc, n;
+  switch (p->type) {
+    case RE_TYPE_LIT:
+      pc = prog_emit(c, RE_OP_CHAR);
+      if (c->inst) c->inst[pc].ch = p->ch;
+      return true;
+    case RE_TYPE_DOT:
+      prog_emit(c, RE_OP_ANY);
+      return true;
+    case RE_TYPE_BRACKET:
+      pc = prog_emit(c, RE_OP_CLASS);
+      if (c->inst) {
+        unsigned char *set = c->ccl + RE_CCL_SIZE * c->nccl;
+        memcpy(set, RE_CCL(p), RE_CCL_SIZE);
+        c->inst[pc].ccl = (int32_t)(set - (unsigned char *)&c->inst[pc]);
+      }
+      c->nccl++;
+      return true;
+    case RE_TYPE_BEGIN:
+      prog_emit(c, RE_OP_BOL);
+      return true;
+    case RE_TYPE_END:
+      prog_emit(c, RE_OP_EOL);
+      return true;
+    case RE_TYPE_LPAREN:
+      n = p->nsub;
+      pc = prog_emit(c, RE_OP_SAVE);
+      if (c->inst) c->inst[pc].n = 2 * n;
+      if (!prog_compile_alt(c, p + 1, rparen)) return false;
+      pc = prog_emit(c, RE_OP_SAVE);
+      if (c->inst) c->inst[pc].n = 2 * n + 1;
+      return true;
+    default:
+      return false;
   }
+}
 
-  return -1;
+static bool
+prog_compile_question(ReCompiler *c, ReAtom *p, ReAtom *rparen)
+{
+  int split = prog_emit(c, RE_OP_SPLIT);
+  if (!prog_compile_item(c, p, rparen)) return false;
+  prog_patch(c, split, split + 1, c->pc);
+  return true;
 }
 
-static int
-matchrepeat(ReState *rs, ReAtom *c, ReAtom *regexp, const char *text, ReAtom *start)
+static bool
+prog_compile_star(ReCompiler *c, ReAtom *p, ReAtom *rparen)
 {
-  /* regexp points to the RE_TYPE_REPEAT atom */
-  uint8_t rmin = regexp->repeat.min;
-  uint8_t rmax = regexp->repeat.max; /* 0 means unbounded */
-  const char *t = text;
-  int i, len;
+  int split = prog_emit(c, RE_OP_SPLIT);
+  if (!prog_compile_item(c, p, rparen)) return false;
+  prog_patch(c, prog_emit(c, RE_OP_JMP), split, 0);
+  prog_patch(c, split, split + 1, c->pc);
+  return true;
+}
 
-  /* Match mandatory minimum */
-  for (i = 0; i < rmin; i++) {
-    if (matchone(rs, c, t) < 1) return -1;
-    t++;
+static bool
+prog_compile_quantified(ReCompiler *c, ReAtom *p, ReAtom *rparen, ReAtom *q)
+{
+  int i, top;
+  switch (q->type) {
+    case RE_TYPE_QUESTION:
+      return prog_compile_question(c, p, rparen);
+    case RE_TYPE_STAR:
+      return prog_compile_star(c, p, rparen);
+    case RE_TYPE_PLUS:
+      top = c->pc;
+      if (!prog_compile_item(c, p, rparen)) return false;
+      prog_patch(c, prog_emit(c, RE_OP_SPLIT), top, c->pc + 1);
+      return true;
+    case RE_TYPE_REPEAT:
+      /* x{n,m} is expanded to n times x and (m - n) times x? */
+      for (i = 0; i < q->repeat.min; i++) {
+        if (!prog_compile_item(c, p, rparen)) return false;
+      }
+      if (q->repeat.max == 0) return prog_compile_star(c, p, rparen);
+      for (; i < q->repeat.max; i++) {
+        if (!prog_compile_question(c, p, rparen)) return false;
+      }
+      return true;
+    default:
+      return false;
   }
+}
 
-  if (rmax == 0) {
-    /* {n,} - unbounded: greedy match as many as possible */
-    const char *end = t;
-    while (*end != '\0' && matchone(rs, c, end) > 0) end++;
-    /* Try from longest to shortest */
-    while (end >= t) {
-      len = matchhere(rs, regexp + 1, end, start);
-      if (len >= 0) return (end - text) + len;
-      if (end == t) break;
-      end--;
+/* atoms from p until end (or RE_TYPE_TERM if end is NULL) */
+static bool
+prog_compile_seq(ReCompiler *c, ReAtom *p, ReAtom *end)
+{
+  ReAtom *rparen, *next;
+  while (p != end && p->type != RE_TYPE_TERM) {
+    rparen = NULL;
+    switch (p->type) {
+      case RE_TYPE_LPAREN:
+        rparen = find_rparen(p);
+        if (!rparen || !p->nsub) return false; // (?> needs the backtracker
+        next = rparen + 1;
+        break;
+      case RE_TYPE_LIT:
+      case RE_TYPE_DOT:
+      case RE_TYPE_BRACKET:
+      case RE_TYPE_BEGIN:
+      case RE_TYPE_END:
+        next = p + 1;
+        break;
+      default:
+        return false; // quantifier without operand or stray )
     }
-    return -1;
+    if (next != end && is_quantifier(next)) {
+      if (p->type == RE_TYPE_BEGIN || p->type == RE_TYPE_END) return false;
+      if (next->repeat.possessive) return false; // so does a possessive quantifier
+      if (!prog_compile_quantified(c, p, rparen, next)) return false;
+      next++;
+    } else {
+      if (!prog_compile_item(c, p, rparen)) return false;
+    }
+    if (c->pc > RE_PROG_MAX) return false;
+    p = next;
   }
+  return true;
+}
 
-  /* {n,m} or {n} - greedy match up to max */
-  {
-    const char *end = t;
-    int count = rmin;
-    while (count < rmax && *end != '\0' && matchone(rs, c, end) > 0) {
-      end++;
-      count++;
-    }
-    /* Try from longest to shortest (greedy) */
-    while (end >= t) {
-      len = matchhere(rs, regexp + 1, end, start);
-      if (len >= 0) return (end - text) + len;
-      if (end == t) break;
-      end--;
+/*
+ * branches separated by | from p until end
+ * Up to RE_ALT_MAX branches are forked by RE_OP_ALT, more of them by
+ * a chain of RE_OP_SPLIT. Each branch but the last jumps to the end.
+ */
+static bool
+prog_compile_alt(ReCompiler *c, ReAtom *p, ReAtom *end)
+{
+  ReAtom *bar = find_alt(p, end);
+  ReAlt *alt = NULL;
+  int i, pc, split, next, jmp = -1, nbranch = 1;
+  bool dispatch;
+  if (!bar) return prog_compile_seq(c, p, end);
+
+  for (; bar; bar = find_alt(bar + 1, end)) nbranch++;
+  dispatch = (nbranch <= RE_ALT_MAX);
+  if (dispatch) {
+    pc = prog_emit(c, RE_OP_ALT);
+    if (c->inst) {
+      alt = &c->alt[c->nalt];
+      alt->nbranch = nbranch;
+      c->inst[pc].alt = (int32_t)((char *)alt - (char *)&c->inst[pc]);
     }
+    c->nalt++;
   }
-  return -1;
+  for (i = 0;; i++) {
+    bar = find_alt(p, end);
+    split = (bar && !dispatch) ? prog_emit(c, RE_OP_SPLIT) : -1;
+    if (alt) alt->pc[i] = c->pc;
+    if (!prog_compile_seq(c, p, bar ? bar : end)) return false;
+    if (!bar) break;
+    /* the JMPs are linked through x until the end is known, the first one to itself */
+    pc = prog_emit(c, RE_OP_JMP);
+    prog_patch(c, pc, jmp < 0 ? pc : jmp, 0);
+    jmp = pc;
+    if (split >= 0) prog_patch(c, split, split + 1, c->pc);
+    p = bar + 1;
+  }
+  while (c->inst) {
+    next = c->inst[jmp].x;
+    prog_patch(c, jmp, c->pc, 0);
+    if (next == jmp) break;
+    jmp = next;
+  }
+  return c->pc <= RE_PROG_MAX;
 }
 
-static int
-match_group_repeat(ReState *rs, ReAtom *lparen, ReAtom *rparen, ReAtom *repeat_atom, const char *text, ReAtom *start)
+/*
+ * all patterns of a regset_t as one program, each ends in its own RE_OP_MATCH
+ * forked by a chain of RE_OP_SPLIT. No capture is saved.
+ */
+static bool
+prog_compile_set(ReCompiler *c)
 {
-  uint8_t rmin = repeat_atom->repeat.min;
-  uint8_t rmax = repeat_atom->repeat.max; /* 0 means unbounded */
-  int i, len_g, len, count;
-  size_t text_len = strlen(rs->original_text_top_addr);
+  size_t i;
+  int pc, split;
+  for (i = 0; i < c->npat; i++) {
+    split = (i + 1 < c->npat) ? prog_emit(c, RE_OP_SPLIT) : -1;
+    if (!prog_compile_alt(c, c->pats[i].atoms, NULL)) return false;
+    pc = prog_emit(c, RE_OP_MATCH);
+    if (c->inst) c->inst[pc].n = (uint16_t)i;
+    if (split >= 0) prog_patch(c, split, split + 1, c->pc);
+    if (c->pc > RE_PROG_MAX) return false;
+  }
+  return true;
+}
 
-  int saved_mid[text_len];
-  memcpy(saved_mid, rs->match_index_data, sizeof(int) * text_len);
-  int saved_nsub_stack_ptr = rs->nsub_stack_ptr;
-  int saved_current_re_nsub = rs->current_re_nsub;
-  int saved_max_re_nsub = rs->max_re_nsub;
+static bool
+prog_compile(ReCompiler *c)
+{
+  int pc;
+  if (c->pats) return prog_compile_set(c);
+  pc = prog_emit(c, RE_OP_SAVE);
+  if (c->inst) c->inst[pc].n = 0;
+  if (!prog_compile_alt(c, c->atoms, NULL)) return false;
+  pc = prog_emit(c, RE_OP_SAVE);
+  if (c->inst) c->inst[pc].n = 1;
+  pc = prog_emit(c, RE_OP_MATCH);
+  if (c->inst) c->inst[pc].n = 0;
+  return c->pc <= RE_PROG_MAX;
+}
 
-  /*
-   * Greedy: collect positions after each group match.
-   * positions[i] = cumulative length after matching i groups.
-   * Max possible matches limited to 255 (uint8_t max).
-   */
-  int limit = (rmax == 0) ? 255 : rmax;
-  int positions[limit + 1];
-  positions[0] = 0;
-  count = 0;
-
-  const char *t = text;
-  while (count < limit) {
-    len_g = match_group_content_once(rs, lparen, rparen, t, start);
-    if (len_g < 1) break;
-    count++;
-    positions[count] = positions[count - 1] + len_g;
-    t += len_g;
+/*
+ * byte classes to shrink the DFA transition tables
+ */
+static void
+prog_byteclass(ReProg *prog)
+{
+  bool boundary[256] = { false };
+  const ReInst *ip;
+  int b, cls = 0;
+  for (ip = prog->inst; ip < prog->inst + prog->len; ip++) {
+    if (ip->op == RE_OP_CHAR) {
+      boundary[ip->ch] = true;
+      if (ip->ch < 255) boundary[ip->ch + 1] = true;
+    } else if (ip->op == RE_OP_CLASS) {
+      for (b = 1; b < 256; b++) {
+        if (ccl_match(RE_CCL(ip), b) != ccl_match(RE_CCL(ip), b - 1)) boundary[b] = true;
+      }
+    }
   }
-
-  /* Not enough matches for minimum */
-  if (count < rmin) {
-    rs->nsub_stack_ptr = saved_nsub_stack_ptr;
-    rs->current_re_nsub = saved_current_re_nsub;
-    rs->max_re_nsub = saved_max_re_nsub;
-    memcpy(rs->match_index_data, saved_mid, sizeof(int) * text_len);
-    return -1;
+  if (prog->newline) {
+    /* ^ and $ tell a line break from the other bytes */
+    boundary['\n'] = true;
+    boundary['\n' + 1] = true;
+  }
+  for (b = 0; b < 256; b++) {
+    if (b > 0 && boundary[b]) cls++;
+    prog->byteclass[b] = cls;
   }
+  prog->nclass = cls + 1;
+}
 
-  /* Try from longest (greedy) to shortest (minimum) */
-  for (i = count; i >= rmin; i--) {
-    /* Restore state before trying rest */
-    rs->nsub_stack_ptr = saved_nsub_stack_ptr;
-    rs->current_re_nsub = saved_current_re_nsub;
-    rs->max_re_nsub = saved_max_re_nsub;
-    memcpy(rs->match_index_data, saved_mid, sizeof(int) * text_len);
+/*
+ * bytes that can come next when the thread is at pc, as bit in first[]
+ * seen[] keeps loops from being followed twice
+ */
+static void
+prog_first(const ReProg *prog, uint16_t pc, uint64_t bit, uint64_t *first, bool *seen)
+{
+  const ReInst *ip;
+  int b;
+  if (seen[pc]) return;
+  seen[pc] = true;
+  ip = &prog->inst[pc];
+  switch (ip->op) {
+    case RE_OP_CHAR:
+      first[ip->ch] |= bit;
+      break;
+    case RE_OP_CLASS:
+      for (b = 0; b < 256; b++) {
+        if (ccl_match(RE_CCL(ip), b)) first[b] |= bit;
+      }
+      break;
+    case RE_OP_ANY:
+      for (b = 0; b < 256; b++) first[b] |= bit;
+      break;
+    case RE_OP_MATCH:
+      for (b = 0; b < 257; b++) first[b] |= bit;
+      break;
+    case RE_OP_EOL:
+      first[256] |= bit;
+      if (prog->newline) first['\n'] |= bit;
+      break;
+    case RE_OP_BOL:
+    case RE_OP_SAVE:
+      prog_first(prog, pc + 1, bit, first, seen);
+      break;
+    case RE_OP_JMP:
+      prog_first(prog, ip->x, bit, first, seen);
+      break;
+    case RE_OP_SPLIT:
+      prog_first(prog, ip->x, bit, first, seen);
+      prog_first(prog, ip->y, bit, first, seen);
+      break;
+    case RE_OP_ALT:
+      for (b = 0; b < RE_ALT(ip)->nbranch; b++) prog_first(prog, RE_ALT(ip)->pc[b], bit, first, seen);
+      break;
+  }
+}
 
-    /* Re-match exactly i groups to rebuild state */
-    t = text;
-    int j;
-    bool ok = true;
-    for (j = 0; j < i; j++) {
-      len_g = match_group_content_once(rs, lparen, rparen, t, start);
-      if (len_g < 1) { ok = false; break; }
-      t += len_g;
+/* fills the dispatch tables, false if out of memory */
+static bool
+prog_dispatch(const regex_t *preg, ReProg *prog)
+{
+  bool *seen = NULL;
+  int pc, i;
+  for (pc = 0; pc < prog->len; pc++) {
+    ReAlt *alt;
+    if (prog->inst[pc].op != RE_OP_ALT) continue;
+    alt = (ReAlt *)RE_ALT(&prog->inst[pc]);
+    if (!seen) {
+      seen = preg->alloc_fn(preg->alloc_ctx, sizeof(bool) * prog->len);
+      if (!seen) return false;
     }
-    if (!ok) continue;
+    memset(alt->first, 0, sizeof(alt->first));
+    for (i = 0; i < alt->nbranch; i++) {
+      memset(seen, 0, sizeof(bool) * prog->len);
+      prog_first(prog, alt->pc[i], (uint64_t)1 << i, alt->first, seen);
+    }
+  }
+  if (seen) preg->free_fn(preg->alloc_ctx, seen);
+  return true;
+}
 
-    len = matchhere(rs, repeat_atom + 1, text + positions[i], start);
-    if (len >= 0) return positions[i] + len;
+/*
+ * the program of preg, or of npat patterns in pats when pats is given.
+ * Memory comes from preg's allocator.
+ */
+static ReProg *
+prog_new(const regex_t *preg, const regex_t *pats, size_t npat)
+{
+  ReCompiler c = { preg->atoms, pats, npat, NULL, 0, NULL, 0, NULL, 0 };
+  ReProg *prog;
+  size_t alt_offset, size;
+  if (!prog_compile(&c)) return NULL;
+  /* inst | alt (8-byte aligned) | ccl */
+  alt_offset = (sizeof(ReProg) + sizeof(ReInst) * c.pc + 7) & ~(size_t)7;
+  size = alt_offset + sizeof(ReAlt) * c.nalt + RE_CCL_SIZE * c.nccl;
+  prog = preg->alloc_fn(preg->alloc_ctx, size);
+  if (!prog) return NULL;
+  memset(prog, 0, size); // no byte of an image is left unset, see regsave()
+  c.inst = prog->inst;
+  c.alt = (ReAlt *)((char *)prog + alt_offset);
+  c.ccl = (unsigned char *)(c.alt + c.nalt);
+  c.pc = 0;
+  c.nalt = 0;
+  c.nccl = 0;
+  prog_compile(&c);
+  prog->size = (uint32_t)size;
+  prog->len = c.pc;
+  prog->newline = (preg->cflags & REG_NEWLINE) != 0;
+  prog->anchored = (!pats && !prog->newline && preg->atoms->type == RE_TYPE_BEGIN &&
+                    !find_alt(preg->atoms, NULL));
+  prog_byteclass(prog);
+  if (!prog_dispatch(preg, prog)) {
+    preg->free_fn(preg->alloc_ctx, prog);
+    return NULL;
   }
+  return prog;
+}
 
-  /* All attempts failed */
-  rs->nsub_stack_ptr = saved_nsub_stack_ptr;
-  rs->current_re_nsub = saved_current_re_nsub;
-  rs->max_re_nsub = saved_max_re_nsub;
-  memcpy(rs->match_index_data, saved_mid, sizeof(int) * text_len);
-  return -1;
+static ReAtom *
+atom_reverse(ReAtom *out, const ReAtom *p, unsigned char **ccl)
+{
+  *out = *p;
+  if (p->type == RE_TYPE_BRACKET) {
+    memcpy(*ccl, RE_CCL(p), RE_CCL_SIZE);
+    out->ccl = (int32_t)(*ccl - (unsigned char *)out);
+    *ccl += RE_CCL_SIZE;
+  } else if (p->type == RE_TYPE_BEGIN) {
+    out->type = RE_TYPE_END;
+  } else if (p->type == RE_TYPE_END) {
+    out->type = RE_TYPE_BEGIN;
+  }
+  return out + 1;
 }
 
-static int
-matchbetween(const unsigned char* s, const char *text)
+/*
+ * writes p..end to out with its pieces (an atom or a group, with the
+ * quantifier after it) in reverse order, the branches of | and the content
+ * of groups reversed the same way, ^ and $ swapped. Sets are copied to
+ * *ccl. Returns the atom after the last one written, NULL if a quantifier
+ * or ) has nothing to apply to.
+ */
+static ReAtom *
+atoms_reverse(ReAtom *out, const ReAtom *p, const ReAtom *end, unsigned char **ccl)
 {
-  if ((text[0] != '-') && (s[0] != '\0') && (s[0] != '-') &&
-      (s[1] == '-') && (s[1] != '\0') &&
-      (s[2] != '\0') && ((text[0] >= s[0]) && (text[0] <= s[2]))) {
-    return 1;
+  const ReAtom *bar = find_alt(p, end), *q, *next;
+  if (bar) {
+    if (!(out = atoms_reverse(out, p, bar, ccl))) return NULL;
+    out->type = RE_TYPE_ALT;
+    return atoms_reverse(out + 1, bar + 1, end, ccl);
+  }
+  if (at_end(p, end)) return out;
+  if (is_quantifier((ReAtom *)p) || p->type == RE_TYPE_RPAREN) return NULL;
+  q = (p->type == RE_TYPE_LPAREN ? p + p->span : p) + 1; // after the atom or the )
+  next = is_quantifier((ReAtom *)q) ? q + 1 : q;
+  /* the pieces after this one come first */
+  if (!(out = atoms_reverse(out, next, end, ccl))) return NULL;
+  if (p->type == RE_TYPE_LPAREN) {
+    out->type = RE_TYPE_LPAREN;
+    out->nsub = p->nsub;
+    if (!(out = atoms_reverse(out + 1, p + 1, p + p->span, ccl))) return NULL;
+    out = atom_reverse(out, p + p->span, ccl);
   } else {
-    return -1;
+    out = atom_reverse(out, p, ccl);
   }
+  if (next != q) out = atom_reverse(out, q, ccl);
+  return out;
 }
 
-static int
-matchchars(ReState *rs, const unsigned char* s, const char *text)
-{
-  if (text[0] == '\0') return -1;
-  do {
-    // Check for ranges first
-    if (s[0] != '\0' && s[1] == '-' && s[2] != '\0') { // Potential range
-      if (matchbetween(s, text) > 0) {
-        REPORT;
-        return 1;
-      }
-      s += 2; // Skip the range (e.g., 'a-z')
-    }
-    // Handle escaped characters
-    else if (s[0] == '\\') {
-      s += 1;
-      if (text[0] == s[0]) {
-        REPORT;
-        return 1;
-      }
-    }
-    // Handle literal characters
-    else if (text[0] == s[0]) {
-      REPORT;
-      return 1;
+/*
+ * program matching the reverse of the matches of preg, for a pattern
+ * ending with $ and not starting with ^ (which is anchored already).
+ * NULL if there is none.
+ */
+static ReProg *
+rprog_new(const regex_t *preg)
+{
+  regex_t rev = *preg;
+  const ReAtom *p;
+  ReAtom *atoms, *last;
+  unsigned char *ccl;
+  size_t n, nccl = 0;
+  ReProg *prog;
+  if (preg->cflags & REG_NEWLINE) return NULL; // $ can be before any line break
+  if (preg->atoms->type == RE_TYPE_BEGIN || find_alt(preg->atoms, NULL)) return NULL;
+  for (p = preg->atoms; p->type != RE_TYPE_TERM; p++) {
+    if (p->type == RE_TYPE_LPAREN && !p->span) return NULL;
+    if (p->type == RE_TYPE_BRACKET) nccl++;
+  }
+  n = p - preg->atoms;
+  if (n == 0 || p[-1].type != RE_TYPE_END) return NULL;
+  atoms = preg->alloc_fn(preg->alloc_ctx, sizeof(ReAtom) * (n + 1) + RE_CCL_SIZE * nccl);
+  if (!atoms) return NULL;
+  ccl = (unsigned char *)(atoms + n + 1);
+  last = atoms_reverse(atoms, preg->atoms, NULL, &ccl);
+  prog = NULL;
+  if (last && last == atoms + n) {
+    last->type = RE_TYPE_TERM;
+    link_parens(atoms);
+    rev.atoms = atoms;
+    prog = prog_new(&rev, NULL, 0);
+  }
+  preg->free_fn(preg->alloc_ctx, atoms);
+  return prog;
+}
+
+/*
+ * A quantified group containing another quantifier, like (a*)* or (\w+)+,
+ * makes the backtracker exponential.
+ */
+static bool
+has_nested_quantifier(ReAtom *atoms)
+{
+  ReAtom *p, *q, *rparen;
+  for (p = atoms; p->type != RE_TYPE_TERM; p++) {
+    if (p->type != RE_TYPE_LPAREN) continue;
+    rparen = find_rparen(p);
+    if (!rparen) return false;
+    if (!is_quantifier(rparen + 1)) continue;
+    for (q = p + 1; q < rparen; q++) {
+      if (is_quantifier(q)) return true;
     }
-  } while (*s++ != '\0');
-  return -1;
+  }
+  return false;
+}
+
+static bool
+has_alternation(ReAtom *atoms)
+{
+  ReAtom *p;
+  for (p = atoms; p->type != RE_TYPE_TERM; p++) {
+    if (p->type == RE_TYPE_ALT) return true;
+  }
+  return false;
+}
+
+/* adds the bytes the single-byte atom p matches to set */
+static void
+atom_bytes(const ReAtom *p, unsigned char *set)
+{
+  int i;
+  switch (p->type) {
+    case RE_TYPE_LIT:
+      set[p->ch >> 3] |= 1 << (p->ch & 7);
+      break;
+    case RE_TYPE_DOT:
+      memset(set, 0xFF, RE_CCL_SIZE);
+      break;
+    case RE_TYPE_BRACKET:
+      for (i = 0; i < RE_CCL_SIZE; i++) set[i] |= RE_CCL(p)[i];
+      break;
+    default:
+      break;
+  }
 }
 
-static int
-match(ReState *rs, ReAtom *regexp, const char *text, ReAtom *start)
+/*
+ * adds the bytes a match of p..end can start with to set, those of every
+ * branch of a |. false if they aren't known: the match can be empty or
+ * starts with ^ or $.
+ */
+static bool
+first_bytes(const ReAtom *p, const ReAtom *end, unsigned char *set)
 {
-  if (regexp->type == RE_TYPE_BEGIN) {
-    if (matchhere(rs, (regexp + 1), text, start) >= 0) return 0;
-    else return -1;
-  }
-  do {    /* must look even if string is empty */
-    if (matchhere(rs, regexp, text, start) >= 0) {
-      return 0;
-    } else {
-      /* reset match_index_data */
-      memset(rs->match_index_data, 0, sizeof(int) * strlen(text));
-      rs->current_re_nsub = 0;
-      rs->max_re_nsub = 0;
-      rs->nsub_stack_ptr = 0;
+  const ReAtom *next, *alt = find_alt(p, end);
+  int rmin, rmax;
+  if (alt) return first_bytes(p, alt, set) && first_bytes(alt + 1, end, set);
+  for (; !at_end(p, end); p = next) {
+    switch (p->type) {
+      case RE_TYPE_LIT:
+      case RE_TYPE_DOT:
+      case RE_TYPE_BRACKET:
+        atom_bytes(p, set);
+        break;
+      case RE_TYPE_LPAREN:
+        if (!p->span || !first_bytes(p + 1, p + p->span, set)) return false;
+        p += p->span;
+        break;
+      default:
+        return false;
     }
-  } while (*text++ != '\0');
-  return -1;
+    next = repeat_limits(p, &rmin, &rmax);
+    if (rmin > 0) return true; // the bytes after it can't start a match
+  }
+  return false;
 }
 
-void
-set_match_data(ReState *rs, size_t nmatch, regmatch_t *pmatch, size_t len)
+/*
+ * bytes that can come first after p in a pattern of single-byte atoms and
+ * plain groups: those of each atom up to the first one that can't be
+ * skipped. $ comes as \n with REG_NEWLINE, and as nothing otherwise.
+ */
+static void
+follow_bytes(const ReAtom *p, unsigned char *set, bool newline)
 {
-  int i, j;
-  for (i = 0; i < nmatch; i++) {
-    (pmatch + i)->rm_so = -1;
-    (pmatch + i)->rm_eo = -1;
-  }
-  bool scanning = false;
-  for (i = len - 1; i > -1; i--) {
-    if (rs->match_index_data[i] == 0) {
-      if (scanning) break;
+  const ReAtom *next;
+  int rmin, rmax;
+  memset(set, 0, RE_CCL_SIZE);
+  for (; p->type != RE_TYPE_TERM; p = next) {
+    if (p->type == RE_TYPE_LPAREN || p->type == RE_TYPE_RPAREN) {
+      next = p + 1;
       continue;
-    } else {
-      scanning = true;
     }
-    for (j = 0; j < nmatch; j++) {
-      if (rs->match_index_data[i] & (1 << j)) {
-        if ((pmatch + j)->rm_eo < 0)
-          (pmatch + j)->rm_eo = i + 1;
-        (pmatch + j)->rm_so = i;
-      }
+    if (p->type == RE_TYPE_END) {
+      if (newline) set['\n' >> 3] |= 1 << ('\n' & 7);
+      return;
     }
-  }
-  if (scanning) {
-    pmatch[0].rm_so = i + 1;
+    atom_bytes(p, set);
+    next = repeat_limits(p, &rmin, &rmax);
+    if (rmin > 0) return;
   }
 }
 
 /*
- * public functions
+ * The backtracker never has to go back on a pattern of single-byte atoms,
+ * quantified or not, and unquantified groups, if no atom with a choice of
+ * repetitions matches a byte that can follow it: then only the longest run
+ * of each can lead to a match. ^ and $ may only be at the ends.
  */
-int
-regexec(regex_t *preg, const char *text, size_t nmatch, regmatch_t *pmatch, int _eflags)
+static void
+onepass_init(regex_t *preg)
 {
-  ReState rs;
-  rs.original_text_top_addr = (void *)text;
-  size_t len = strlen(text);
-  int mid[len];
-  rs.match_index_data = mid;
-  memset(rs.match_index_data, 0, sizeof(int) * len);
-  rs.current_re_nsub = 0;
-  rs.max_re_nsub = 0;
-  rs.nsub_stack_ptr = 0;
-  if (match(&rs, preg->atoms, text, preg->atoms) >= 0) {
-    set_match_data(&rs, nmatch, pmatch, len);
-    return 0; /* success */
-  } else {
-    return -1; /* to be correct, it should be a thing like REG_NOMATCH */
+  const ReAtom *p, *next;
+  unsigned char set[RE_CCL_SIZE], follow[RE_CCL_SIZE];
+  int i, rmin, rmax, nparen = 0;
+  preg->onepass = false;
+  if (preg->prog) return; // the Pike VM has no backtracking to cut
+  for (p = preg->atoms; p->type != RE_TYPE_TERM; p = next) {
+    next = p + 1;
+    switch (p->type) {
+      case RE_TYPE_LPAREN:
+        if (!p->span || is_quantifier((ReAtom *)p + p->span + 1)) return;
+        nparen++;
+        continue;
+      case RE_TYPE_RPAREN:
+        if (--nparen < 0) return; // no ( before it
+        continue;
+      case RE_TYPE_BEGIN:
+        if (p != preg->atoms) return;
+        continue;
+      case RE_TYPE_END:
+        if (next->type != RE_TYPE_TERM) return;
+        continue;
+      case RE_TYPE_LIT:
+      case RE_TYPE_DOT:
+      case RE_TYPE_BRACKET:
+        break;
+      default:
+        return; // |, or a quantifier with nothing before it
+    }
+    next = repeat_limits(p, &rmin, &rmax);
+    if (is_quantifier((ReAtom *)next)) return;
+    if ((rmax != 0 && rmin == rmax) || (p + 1)->repeat.possessive) continue; // nothing to choose
+    memset(set, 0, RE_CCL_SIZE);
+    atom_bytes(p, set);
+    follow_bytes(next, follow, (preg->cflags & REG_NEWLINE) != 0);
+    for (i = 0; i < RE_CCL_SIZE; i++) {
+      if (set[i] & follow[i]) return;
+    }
   }
+  preg->onepass = true;
 }
 
-size_t
-gen_ccl(ReAtom *atom, unsigned char **ccl, const char *snippet, size_t len, bool dry_run)
+/*
+ * bytes a match can start with, for the backtracker to skip the positions
+ * no match can start at
+ */
+static void
+first_init(regex_t *preg)
 {
-  if (len == 0) len = strlen(snippet);
-  if (!dry_run) {
-    memcpy(*ccl, snippet, len);
-    (*ccl)[len] = '\0';
-    atom->ccl = *ccl;
-    atom->type = RE_TYPE_BRACKET;
-    *ccl += len + 1;
-  }
-  return len + 1;
+  int i;
+  memset(preg->first, 0, sizeof(preg->first));
+  preg->has_first = first_bytes(preg->atoms, NULL, preg->first);
+  for (i = 0; i < RE_CCL_SIZE && preg->first[i] == 0xFF; i++);
+  if (i == RE_CCL_SIZE) preg->has_first = false; // every byte can
 }
-#define gen_ccl_const(atom, ccl, snippet, dry_run) gen_ccl(atom, ccl, snippet, 0, dry_run)
 
 /*
- * compile regular expression pattern
- * _cflags is dummy
+ * find the longest literal string that every match contains,
+ * looking at the atoms outside of groups
  */
-#define REGEX_DEF_w "a-zA-Z0-9_"
-#define REGEX_DEF_s " \t\f\r\n"
-#define REGEX_DEF_d "0-9"
-int
-regcomp(regex_t *preg, const char *pattern, int _cflags,
-        void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn)
+static ReLit *
+lit_new(regex_t *preg)
+{
+  unsigned char buf[RE_LIT_MAX], best[RE_LIT_MAX];
+  size_t len = 0, best_len = 0;
+  bool prefix = true, best_prefix = false;
+  ReAtom *p = preg->atoms;
+  ReLit *lit;
+  int i, n;
+
+  if (find_alt(p, NULL)) return NULL; // no literal is common to all branches
+  if (p->type == RE_TYPE_BEGIN) p++;
+  for (;; p++) {
+    if (p->type == RE_TYPE_LIT) {
+      /* how many times the literal is required, and if the run goes on */
+      bool goes_on = true;
+      n = 1;
+      switch ((p + 1)->type) {
+        case RE_TYPE_QUESTION:
+        case RE_TYPE_STAR:
+          n = 0;
+          goes_on = false;
+          break;
+        case RE_TYPE_PLUS:
+          goes_on = false;
+          break;
+        case RE_TYPE_REPEAT:
+          n = (p + 1)->repeat.min;
+          goes_on = (n == (p + 1)->repeat.max && n > 0);
+          break;
+        default:
+          break;
+      }
+      for (i = 0; i < n && len < RE_LIT_MAX; i++) buf[len++] = p->ch;
+      if (goes_on && len < RE_LIT_MAX) continue;
+      if (is_quantifier(p + 1)) p++;
+    }
+    if (len > best_len) {
+      memcpy(best, buf, len);
+      best_len = len;
+      best_prefix = prefix;
+    }
+    len = 0;
+    prefix = false;
+    if (p->type == RE_TYPE_TERM) break;
+    if (p->type == RE_TYPE_LPAREN && p->span) p += p->span;
+  }
+  if (best_len == 0) return NULL;
+  lit = preg->alloc_fn(preg->alloc_ctx, sizeof(ReLit) + best_len);
+  if (!lit) return NULL;
+  memset(lit, 0, sizeof(ReLit));
+  lit->prefix = best_prefix;
+  lit->len = (uint16_t)best_len;
+  memcpy(lit->str, best, best_len);
+  return lit;
+}
+
+static void
+preg_init(regex_t *preg, int cflags,
+          void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn)
 {
   preg->alloc_ctx = alloc_ctx;
   preg->alloc_fn = alloc_fn;
   preg->free_fn = free_fn;
-  ReAtom *atoms = preg->alloc_fn(preg->alloc_ctx, sizeof(ReAtom));
   preg->re_nsub = 0;
+  preg->prog = NULL;
+  preg->rprog = NULL;
+  preg->lit = NULL;
+  preg->image = NULL;
+  preg->cflags = cflags;
+  preg->dfa_cache_size = RE_DFA_CACHE_SIZE;
+  preg->has_first = false;
+  preg->onepass = false;
+}
+
+/*
+ * parse pattern into preg->atoms
+ */
+static int
+atoms_new(regex_t *preg, const char *pattern)
+{
+  ReAtom *atoms = preg->alloc_fn(preg->alloc_ctx, sizeof(ReAtom));
   size_t ccl_len = 0; // total length of ccl(s)
   size_t len;
-  bool dry_run = true;
+  bool dry_run = true, quantifier;
   char *pattern_index = (char *)pattern;
-  uint16_t atoms_count = 1;
+  size_t atoms_count = 1;
   unsigned char *ccl = '\0';
+  if (!atoms) return -1;
   /*
    * Just calculates size of atoms as a dry-run,
    * then makes atoms and ccl(s) at the second time
    */
   for (;;) {
     while (pattern_index[0] != '\0') {
+      quantifier = false;
       switch (pattern_index[0]) {
         case '.':
-          atoms->type = RE_TYPE_DOT;
+          if (preg->cflags & REG_NEWLINE) {
+            ccl_len += gen_ccl_const(atoms, &ccl, "^\n", dry_run); // any but a line break
+          } else {
+            atoms->type = RE_TYPE_DOT;
+          }
           break;
         case '?':
           atoms->type = RE_TYPE_QUESTION;
+          quantifier = true;
           break;
         case '*':
           atoms->type = RE_TYPE_STAR;
+          quantifier = true;
           break;
         case '+':
           atoms->type = RE_TYPE_PLUS;
+          quantifier = true;
           break;
         case '{': {
           /* Parse {n}, {n,}, {n,m} */
@@ -667,6 +2474,7 @@ regcomp(regex_t *preg, const char *pattern, int _cflags,
               atoms->repeat.min = rmin;
               atoms->repeat.max = has_comma && rmax == 0 ? 0 : rmax;
             }
+            quantifier = true;
             pattern_index = p; /* will be incremented at end of loop */
           } else {
             /* Not a valid quantifier, treat { as literal */
@@ -683,11 +2491,20 @@ regcomp(regex_t *preg, const char *pattern, int _cflags,
           break;
         case '(':
           atoms->type = RE_TYPE_LPAREN;
-          if (!dry_run) preg->re_nsub++;
+          if (pattern_index[1] == '?' && pattern_index[2] == '>') {
+            /* atomic group, which doesn't capture */
+            if (!dry_run) atoms->nsub = 0;
+            pattern_index += 2;
+          } else if (!dry_run) {
+            atoms->nsub = (uint32_t)++preg->re_nsub;
+          }
           break;
         case ')':
           atoms->type = RE_TYPE_RPAREN;
           break;
+        case '|':
+          atoms->type = RE_TYPE_ALT;
+          break;
         case '\\':
           switch (pattern_index[1]) {
             case '\0':
@@ -706,6 +2523,18 @@ regcomp(regex_t *preg, const char *pattern, int _cflags,
               pattern_index++;
               ccl_len += gen_ccl_const(atoms, &ccl, REGEX_DEF_d, dry_run);
               break;
+            case 'W':
+              pattern_index++;
+              ccl_len += gen_ccl_const(atoms, &ccl, "^" REGEX_DEF_w, dry_run);
+              break;
+            case 'S':
+              pattern_index++;
+              ccl_len += gen_ccl_const(atoms, &ccl, "^" REGEX_DEF_s, dry_run);
+              break;
+            case 'D':
+              pattern_index++;
+              ccl_len += gen_ccl_const(atoms, &ccl, "^" REGEX_DEF_d, dry_run);
+              break;
             default:
               pattern_index++;
               atoms->type = RE_TYPE_LIT;
@@ -716,20 +2545,40 @@ regcomp(regex_t *preg, const char *pattern, int _cflags,
           pattern_index++;
            /*
             * pattern [] must contain at least one letter.
-            * first letter of the content should be ']' if you want to match literal ']'
+            * first letter of the content (after ^ if negated) should be ']'
+            * if you want to match literal ']'. \] works anywhere.
             */
-          for (len = 1;
-              pattern_index[len] != '\0' && (pattern_index[len] != ']');
-              len++)
-            ;
+          len = (pattern_index[0] == '^') ? 1 : 0;
+          if (pattern_index[len] == ']') len++;
+          while (pattern_index[len] != '\0' && pattern_index[len] != ']') {
+            if (pattern_index[len] == '\\' && pattern_index[len + 1] != '\0') len++;
+            len++;
+          }
           ccl_len += gen_ccl(atoms, &ccl, pattern_index, len, dry_run);
+          /* [^...] doesn't match a line break with REG_NEWLINE */
+          if (!dry_run && pattern_index[0] == '^' && len > 1 && (preg->cflags & REG_NEWLINE))
+            ((unsigned char *)atoms + atoms->ccl)['\n' >> 3] &= ~(1 << ('\n' & 7));
+          if (!dry_run && (preg->cflags & REG_ICASE))
+            ccl_fold((unsigned char *)atoms + atoms->ccl, pattern_index[0] == '^' && len > 1);
           pattern_index += len;
+          if (pattern_index[0] == '\0') pattern_index--; // unterminated [
           break;
         default:
           atoms->type = RE_TYPE_LIT;
           atoms->ch = pattern_index[0];
           break;
       }
+      /* possessive quantifier: *+, ++, ?+, {n,m}+ */
+      if (quantifier) {
+        if (!dry_run) atoms->repeat.possessive = pattern_index[1] == '+';
+        if (pattern_index[1] == '+') pattern_index++;
+      }
+      /* REG_ICASE: a letter becomes the set of its two cases */
+      if ((preg->cflags & REG_ICASE) && atoms->type == RE_TYPE_LIT &&
+          (atoms->ch | 0x20) >= 'a' && (atoms->ch | 0x20) <= 'z') {
+        char both[] = { atoms->ch | 0x20, atoms->ch & ~0x20, '\0' };
+        ccl_len += gen_ccl_const(atoms, &ccl, both, dry_run);
+      }
       pattern_index++;
       if (dry_run) {
         atoms_count++;
@@ -742,6 +2591,8 @@ regcomp(regex_t *preg, const char *pattern, int _cflags,
       pattern_index = (char *)pattern;
       preg->free_fn(preg->alloc_ctx, atoms);
       atoms = (ReAtom *)preg->alloc_fn(preg->alloc_ctx, sizeof(ReAtom) * atoms_count + ccl_len);
+      if (!atoms) return -1;
+      memset(atoms, 0, sizeof(ReAtom) * atoms_count); // each atom sets only some of its fields
       ccl = (unsigned char *)(atoms + atoms_count);
     } else {
       atoms->type = RE_TYPE_TERM;
@@ -749,6 +2600,43 @@ regcomp(regex_t *preg, const char *pattern, int _cflags,
       break;
     }
   }
+  link_parens(preg->atoms);
+  return 0;
+}
+
+/*
+ * compile regular expression pattern
+ * REG_PIKEVM in cflags selects the Pike VM, which is also chosen
+ * automatically for patterns with nested quantifiers or alternation.
+ * Possessive quantifiers and atomic groups are matched by the backtracker
+ * only, and fail to compile with alternation.
+ * REG_NOSUB makes regexec() answer with the lazy DFA.
+ * REG_ICASE is folded into the sets of the atoms here, so matching costs
+ * the same as without it.
+ * A pattern ending with $ also gets a reversed program, to find where a
+ * match can start by reading the text backward from its end.
+ * The other cflags are ignored.
+ */
+int
+regcomp(regex_t *preg, const char *pattern, int cflags,
+        void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn)
+{
+  preg_init(preg, cflags, alloc_ctx, alloc_fn, free_fn);
+  if (atoms_new(preg, pattern) != 0) return -1;
+  preg->lit = lit_new(preg);
+  first_init(preg);
+  /* the backtracker doesn't know |, otherwise it is the fallback */
+  if (has_alternation(preg->atoms)) {
+    preg->prog = prog_new(preg, NULL, 0);
+    if (!preg->prog) {
+      regfree(preg);
+      return -1;
+    }
+  } else if ((cflags & (REG_PIKEVM | REG_NOSUB)) || has_nested_quantifier(preg->atoms)) {
+    preg->prog = prog_new(preg, NULL, 0);
+  }
+  preg->rprog = rprog_new(preg); // optional like the literal
+  onepass_init(preg);
   return 0;
 }
 
@@ -758,6 +2646,609 @@ regcomp(regex_t *preg, const char *pattern, int _cflags,
 void
 regfree(regex_t *preg)
 {
+  if (preg->image) return; // nothing was allocated by regload()
+  if (preg->prog) preg->free_fn(preg->alloc_ctx, preg->prog);
+  if (preg->rprog) preg->free_fn(preg->alloc_ctx, preg->rprog);
+  if (preg->lit) preg->free_fn(preg->alloc_ctx, preg->lit);
   preg->free_fn(preg->alloc_ctx, preg->atoms);
 }
 
+
+/*
+ * image of a compiled pattern
+ * header | atoms and their sets | lit | prog | rprog, each 8-byte aligned.
+ * None of them holds a pointer, so the image works wherever it lies.
+ */
+typedef struct re_image {
+  uint32_t magic;      // RE_IMAGE_MAGIC, also tells the byte order
+  uint16_t atom_size;  // sizeof(ReAtom) and sizeof(ReInst) of the build that wrote it
+  uint16_t inst_size;
+  int32_t cflags;
+  uint32_t nsub;
+  uint32_t atoms_size; // bytes of each part, 0 if there isn't one
+  uint32_t lit_size;
+  uint32_t prog_size;
+  uint32_t rprog_size;
+} ReImage;
+
+#define RE_IMAGE_MAGIC 0x33474552 // "REG3"
+#define RE_IMAGE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* bytes of the atoms and the sets behind them, as atoms_new() allocated them */
+static size_t
+atoms_size(const ReAtom *atoms)
+{
+  const ReAtom *p;
+  size_t nccl = 0;
+  for (p = atoms; p->type != RE_TYPE_TERM; p++) {
+    if (p->type == RE_TYPE_BRACKET) nccl++;
+  }
+  return sizeof(ReAtom) * (p - atoms + 1) + RE_CCL_SIZE * nccl;
+}
+
+/* n bytes at offset at lie within a part of size bytes */
+static inline bool
+image_has(size_t size, int64_t at, size_t n)
+{
+  return at >= 0 && (uint64_t)at <= size && n <= size - (size_t)at;
+}
+
+/*
+ * atoms of an image: a TERM within size bytes, each ( linked to its ) and
+ * numbered up to nsub, and each set within the part
+ */
+static bool
+image_atoms_valid(const ReAtom *atoms, size_t size, uint32_t nsub)
+{
+  const ReAtom *p;
+  size_t i, n = size / sizeof(ReAtom);
+  for (i = 0; i < n && atoms[i].type != RE_TYPE_TERM; i++);
+  if (i == n || nsub > i) return false;
+  for (p = atoms; p->type != RE_TYPE_TERM; p++) {
+    if ((unsigned)p->type > RE_TYPE_ALT) return false;
+    if (p->type == RE_TYPE_BRACKET &&
+        !image_has(size, (const char *)p - (const char *)atoms + p->ccl, RE_CCL_SIZE))
+      return false;
+    if (p->type == RE_TYPE_LPAREN && (p->span != paren_span(p) || p->nsub > nsub)) return false;
+  }
+  return atoms_size(atoms) == size;
+}
+
+/*
+ * program of an image: every jump, branch and next instruction within it,
+ * and each set and dispatch table within its size bytes
+ */
+static bool
+image_prog_valid(const ReProg *prog, size_t size)
+{
+  const ReInst *ip;
+  const ReAlt *alt;
+  int64_t at;
+  int pc, i, c;
+  if (size < sizeof(ReProg) || prog->size != size || prog->len == 0 ||
+      sizeof(ReProg) + sizeof(ReInst) * prog->len > size || prog->nclass == 0 || prog->nclass > 256)
+    return false;
+  for (c = 0; c < 256; c++) {
+    if (prog->byteclass[c] >= prog->nclass) return false;
+  }
+  for (pc = 0; pc < prog->len; pc++) {
+    ip = &prog->inst[pc];
+    at = (const char *)ip - (const char *)prog;
+    switch (ip->op) {
+      case RE_OP_MATCH:
+        continue;
+      case RE_OP_CHAR:
+      case RE_OP_ANY:
+      case RE_OP_BOL:
+      case RE_OP_EOL:
+      case RE_OP_SAVE:
+        break;
+      case RE_OP_CLASS:
+        if (!image_has(size, at + ip->ccl, RE_CCL_SIZE)) return false;
+        break;
+      case RE_OP_SPLIT:
+        if (ip->y >= prog->len) return false;
+        /* fall through */
+      case RE_OP_JMP:
+        if (ip->x >= prog->len) return false;
+        continue;
+      case RE_OP_ALT:
+        if (!image_has(size, at + ip->alt, sizeof(ReAlt)) || (at + ip->alt) % 8 != 0) return false;
+        alt = RE_ALT(ip);
+        if (alt->nbranch > RE_ALT_MAX) return false;
+        for (i = 0; i < alt->nbranch; i++) {
+          if (alt->pc[i] >= prog->len) return false;
+        }
+        for (c = 0; c < 257 && alt->nbranch < 64; c++) {
+          if (alt->first[c] >> alt->nbranch) return false; // a branch it doesn't have
+        }
+        continue;
+      default:
+        return false;
+    }
+    if (pc + 1 >= prog->len) return false; // runs on to the next instruction
+  }
+  return true;
+}
+
+/*
+ * writes the image of preg to buf if it has size bytes of room.
+ * Returns the bytes of the image, so size can be 0 to ask for them.
+ */
+size_t
+regsave(const regex_t *preg, void *buf, size_t size)
+{
+  ReImage h = { RE_IMAGE_MAGIC, sizeof(ReAtom), sizeof(ReInst), preg->cflags, (uint32_t)preg->re_nsub };
+  size_t total, off;
+  h.atoms_size = (uint32_t)atoms_size(preg->atoms);
+  h.lit_size = preg->lit ? (uint32_t)(sizeof(ReLit) + preg->lit->len) : 0;
+  h.prog_size = preg->prog ? preg->prog->size : 0;
+  h.rprog_size = preg->rprog ? preg->rprog->size : 0;
+  total = RE_IMAGE_ALIGN(sizeof(ReImage)) + RE_IMAGE_ALIGN(h.atoms_size)
+        + RE_IMAGE_ALIGN(h.lit_size) + RE_IMAGE_ALIGN(h.prog_size) + h.rprog_size;
+  if (!buf || size < total) return total;
+  memset(buf, 0, total);
+  memcpy(buf, &h, sizeof(ReImage));
+  off = RE_IMAGE_ALIGN(sizeof(ReImage));
+  memcpy((char *)buf + off, preg->atoms, h.atoms_size);
+  off += RE_IMAGE_ALIGN(h.atoms_size);
+  if (preg->lit) memcpy((char *)buf + off, preg->lit, h.lit_size);
+  off += RE_IMAGE_ALIGN(h.lit_size);
+  if (preg->prog) memcpy((char *)buf + off, preg->prog, h.prog_size);
+  off += RE_IMAGE_ALIGN(h.prog_size);
+  if (preg->rprog) memcpy((char *)buf + off, preg->rprog, h.rprog_size);
+  return total;
+}
+
+/*
+ * makes preg from an image regsave() wrote on the same kind of machine,
+ * with no parsing. The image is used in place: it may be read-only (e.g.
+ * mmap'd or in flash), must be 8-byte aligned and must outlive preg.
+ * Matching takes its memory from alloc_fn as with regcomp().
+ * Returns -1 if image doesn't look like one, or if an offset or index in
+ * it points outside of it.
+ */
+int
+regload(regex_t *preg, const void *image, size_t size,
+        void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn)
+{
+  const ReImage *h = image;
+  const char *part = (const char *)image + RE_IMAGE_ALIGN(sizeof(ReImage));
+  const char *lit, *prog, *rprog;
+  if (((uintptr_t)image & 7) != 0 || size < sizeof(ReImage)) return -1;
+  if (h->magic != RE_IMAGE_MAGIC || h->atom_size != sizeof(ReAtom) ||
+      h->inst_size != sizeof(ReInst) || h->atoms_size < sizeof(ReAtom))
+    return -1;
+  if ((uint64_t)size < (uint64_t)RE_IMAGE_ALIGN(sizeof(ReImage)) + RE_IMAGE_ALIGN(h->atoms_size) +
+                       RE_IMAGE_ALIGN(h->lit_size) + RE_IMAGE_ALIGN(h->prog_size) + h->rprog_size)
+    return -1;
+  /* nothing in the image is used before it is known to stay within it */
+  lit = part + RE_IMAGE_ALIGN(h->atoms_size);
+  prog = lit + RE_IMAGE_ALIGN(h->lit_size);
+  rprog = prog + RE_IMAGE_ALIGN(h->prog_size);
+  if (!image_atoms_valid((const ReAtom *)part, h->atoms_size, h->nsub)) return -1;
+  if (h->lit_size && (h->lit_size < sizeof(ReLit) + 1 ||
+                      sizeof(ReLit) + ((const ReLit *)lit)->len != h->lit_size))
+    return -1;
+  if (h->prog_size && !image_prog_valid((const ReProg *)prog, h->prog_size)) return -1;
+  if (h->rprog_size && !image_prog_valid((const ReProg *)rprog, h->rprog_size)) return -1;
+  if (!h->prog_size && has_alternation((ReAtom *)part)) return -1; // the backtracker doesn't know |
+  preg_init(preg, h->cflags, alloc_ctx, alloc_fn, free_fn);
+  preg->image = image;
+  preg->re_nsub = h->nsub;
+  preg->atoms = (ReAtom *)part;
+  part += RE_IMAGE_ALIGN(h->atoms_size);
+  if (h->lit_size) preg->lit = (ReLit *)part;
+  part += RE_IMAGE_ALIGN(h->lit_size);
+  if (h->prog_size) preg->prog = (ReProg *)part;
+  part += RE_IMAGE_ALIGN(h->prog_size);
+  if (h->rprog_size) preg->rprog = (ReProg *)part;
+  first_init(preg);
+  onepass_init(preg);
+  return 0;
+}
+
+/*
+ * compile count patterns into a set matched in one pass.
+ * The id of a pattern is its index in patterns. Captures are not tracked.
+ */
+int
+regset_comp(regset_t *set, const char *const *patterns, size_t count, int cflags,
+            void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn)
+{
+  size_t i;
+  set->alloc_ctx = alloc_ctx;
+  set->alloc_fn = alloc_fn;
+  set->free_fn = free_fn;
+  set->count = 0;
+  set->prog = NULL;
+  set->dfa = NULL;
+  set->dfa_cache_size = RE_SET_DFA_CACHE_SIZE;
+  if (count > RE_SET_DFA_CACHE_SIZE / RE_SET_DFA_CACHE_PER_PATTERN)
+    set->dfa_cache_size = RE_SET_DFA_CACHE_PER_PATTERN * count;
+  if (count == 0 || count > RE_PROG_MAX) return -1;
+  set->pats = alloc_fn(alloc_ctx, sizeof(regex_t) * count);
+  if (!set->pats) return -1;
+  for (i = 0; i < count; i++) {
+    preg_init(&set->pats[i], cflags, alloc_ctx, alloc_fn, free_fn);
+    if (atoms_new(&set->pats[i], patterns[i]) != 0) {
+      regset_free(set);
+      return -1;
+    }
+    set->count++;
+  }
+  set->prog = prog_new(set->pats, set->pats, count);
+  if (!set->prog) {
+    regset_free(set);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * matched[REGSET_WORDS(set->count)] gets the bit of every pattern found
+ * in the first len bytes of text. Returns the number of them, -1 if out of memory.
+ * The text is scanned once by the lazy DFA, and no further once all patterns matched.
+ * The DFA is made by the first call and keeps its states for the next ones,
+ * so a set is matched by one thread at a time.
+ */
+int
+regset_exec(regset_t *set, const char *text, size_t len, uint32_t *matched, int _eflags)
+{
+  const ReProg *prog = set->prog;
+  ReDfa *dfa = set->dfa;
+  ReDfaState *s, *ns;
+  const char *p, *nl, *text_end = text + len;
+  size_t i, nmatched = 0;
+  /* the cache has to hold the largest state, or it could never move on */
+  size_t state_max = sizeof(ReDfaState) + sizeof(ReDfaState *) * prog->nclass
+                   + sizeof(uint16_t) * prog->len + sizeof(void *);
+  size_t cache_size = set->dfa_cache_size < state_max ? state_max : set->dfa_cache_size;
+  size_t head = (sizeof(ReDfa) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+  if (dfa && dfa->cache_size != cache_size) { // dfa_cache_size was changed since
+    set->free_fn(set->alloc_ctx, dfa);
+    dfa = set->dfa = NULL;
+  }
+  if (!dfa) {
+    char *block = set->alloc_fn(set->alloc_ctx, head + dfa_scratch_size(prog) + cache_size);
+    if (!block) return -1;
+    dfa = set->dfa = (ReDfa *)block;
+    dfa_init(dfa, prog, block + head, cache_size);
+  }
+  if (++dfa->run == 0) { // the states reported in an old run would look reported in this one
+    dfa_reset(dfa);
+    dfa->run = 1;
+  }
+
+  for (i = 0; i < REGSET_WORDS(set->count); i++) matched[i] = 0;
+  s = dfa_start(dfa, true);
+  for (p = text; s; p++) {
+    if (s->match && s->reported != dfa->run) {
+      nmatched += dfa_report(dfa, s, p == text, false, matched);
+      s->reported = dfa->run;
+      if (nmatched == set->count) break;
+    }
+    if (p == text_end) break;
+    if (s->npc == 0) {
+      if (!prog->newline || !(nl = scan_newline(p, text_end))) break;
+      p = nl;
+    }
+    if (prog->newline && *p == '\n' && s->eol_match && !s->match) {
+      /* $ before a line break */
+      nmatched += dfa_report(dfa, s, p == text, true, matched);
+      if (nmatched == set->count) break;
+    }
+    ns = s->next[prog->byteclass[(unsigned char)*p]];
+    s = ns ? ns : dfa_next(dfa, s, (unsigned char)*p);
+  }
+  if (s && p == text_end && s->eol_match && nmatched < set->count)
+    nmatched += dfa_report(dfa, s, p == text, true, matched);
+  return (int)nmatched;
+}
+
+/*
+ * free regset_t object
+ */
+void
+regset_free(regset_t *set)
+{
+  size_t i;
+  for (i = 0; i < set->count; i++) regfree(&set->pats[i]);
+  if (set->prog) set->free_fn(set->alloc_ctx, set->prog);
+  if (set->dfa) set->free_fn(set->alloc_ctx, set->dfa);
+  set->free_fn(set->alloc_ctx, set->pats);
+  set->count = 0;
+  set->prog = NULL;
+  set->dfa = NULL;
+}
+
+/*
+ * streaming
+ * The Pike VM runs one byte behind the input, as it needs to see the byte
+ * after the one it steps over. A match is reported once no thread of higher
+ * priority is left, which may be some bytes after its end. The next search
+ * starts again from that end, replaying those bytes from the history.
+ */
+static int
+stream_byte(const regstream_t *st, regoff_t pos)
+{
+  return (unsigned char)st->history[pos % st->history_size];
+}
+
+/* runs the matcher as far as the bytes fed allow, or to the end of the stream */
+static int
+stream_run(regstream_t *st, bool at_end)
+{
+  RePike *vm = st->vm;
+  regoff_t restart, end = st->fed;
+  size_t i, nmatch = st->preg->re_nsub + 1;
+  int c, look, result;
+
+  while (st->pos >= 0 && (st->pos + 1 < end || (at_end && st->pos <= end))) {
+    c = st->pos < end ? stream_byte(st, st->pos) : 256;
+    look = st->pos + 1 < end ? stream_byte(st, st->pos + 1) : 256;
+    if (pike_advance(vm, st->pos, c, look) && st->pos < end) {
+      st->pos++;
+      continue;
+    }
+    if (!vm->matched) {
+      st->pos = -1;
+      break;
+    }
+    for (i = 0; i < nmatch; i++) {
+      st->pmatch[i].rm_so = vm->found[2 * i];
+      st->pmatch[i].rm_eo = vm->found[2 * i + 1];
+    }
+    result = st->fn(st->ctx, nmatch, st->pmatch);
+    if (result) {
+      st->pos = -1;
+      return result;
+    }
+    /* an empty match can't be found twice at the same place */
+    restart = vm->found[1] + (vm->found[0] == vm->found[1]);
+    if (restart - 1 < end - (regoff_t)st->history_size) {
+      st->pos = -1;
+      return -1; // the bytes to search again, or the one before them for ^, are gone
+    }
+    pike_reset(vm);
+    if (restart <= end) vm->prev = stream_byte(st, restart - 1);
+    st->pos = restart;
+  }
+  return 0;
+}
+
+/*
+ * starts matching preg against a stream. fn gets every match, leftmost-first
+ * and not overlapping, with offsets from the start of the stream.
+ * history_size is the most bytes a match can be settled after its end (0 for
+ * the default). All memory is taken here, none while the stream goes on.
+ */
+int
+regstream_init(regstream_t *st, const regex_t *preg, size_t history_size, regstream_fn_t fn, void *ctx)
+{
+  int nslot = 2 * (int)(preg->re_nsub + 1);
+  size_t vm_size = (sizeof(RePike) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  size_t pike, pmatch_size = sizeof(regmatch_t) * (preg->re_nsub + 1);
+  char *block;
+
+  st->preg = preg;
+  st->prog = NULL;
+  if (!preg->prog) {
+    st->prog = prog_new(preg, NULL, 0);
+    if (!st->prog) return -1;
+  }
+  if (history_size == 0) history_size = RE_STREAM_HISTORY;
+  if (history_size < 2) history_size = 2; // a byte and the one after it
+  pike = pike_size(preg->prog ? preg->prog : st->prog, nslot);
+  pike = (pike + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  /* vm | scratch | pmatch | history */
+  block = preg->alloc_fn(preg->alloc_ctx, vm_size + pike + pmatch_size + history_size);
+  if (!block) {
+    if (st->prog) preg->free_fn(preg->alloc_ctx, st->prog);
+    return -1;
+  }
+  st->vm = (RePike *)block;
+  pike_init(st->vm, preg->prog ? preg->prog : st->prog, nslot, block + vm_size);
+  st->pmatch = (regmatch_t *)(block + vm_size + pike);
+  st->history = (char *)st->pmatch + pmatch_size;
+  st->history_size = history_size;
+  st->fed = 0;
+  st->pos = 0;
+  st->fn = fn;
+  st->ctx = ctx;
+  return 0;
+}
+
+/*
+ * 0, or what fn returned to stop, or -1 if a search had to go back further
+ * than the history
+ */
+int
+regstream_feed(regstream_t *st, const char *chunk, size_t len)
+{
+  size_t i;
+  int result;
+  for (i = 0; i < len && st->pos >= 0; i++) {
+    st->history[st->fed % st->history_size] = chunk[i];
+    st->fed++;
+    result = stream_run(st, false);
+    if (result) return result;
+  }
+  st->fed += len - i; // not kept, no match can come any more
+  return 0;
+}
+
+/* settles the matches at the end of the stream and frees st */
+int
+regstream_finish(regstream_t *st)
+{
+  const regex_t *preg = st->preg;
+  int result = stream_run(st, true);
+  if (st->prog) preg->free_fn(preg->alloc_ctx, st->prog);
+  preg->free_fn(preg->alloc_ctx, st->vm);
+  st->vm = NULL;
+  return result;
+}
+
+/*
+ * iterating over matches
+ * The scratch space of the engine is taken once by regiter_init() and
+ * kept from one match to the next.
+ */
+int
+regiter_init(regiter_t *it, const regex_t *preg, const char *text, size_t len)
+{
+  int nslot = 2 * (int)(preg->re_nsub + 1);
+  it->preg = preg;
+  it->text = text;
+  it->len = len;
+  it->pos = 0;
+  it->vm = NULL;
+  it->rs = NULL;
+  if (preg->prog) {
+    it->vm = pike_new(preg, preg->prog, nslot);
+    if (!it->vm) return -1;
+  } else {
+    it->rs = state_new(preg, text, len);
+    if (!it->rs) return -1;
+  }
+  return 0;
+}
+
+/*
+ * the next match after the previous one, not overlapping it.
+ * After an empty match the search goes on from the next position.
+ * 0 if found, otherwise -1, or REG_ESPACE if out of memory
+ */
+int
+regiter_next(regiter_t *it, size_t nmatch, regmatch_t *pmatch)
+{
+  const regex_t *preg = it->preg;
+  const char *p, *text_end = it->text + it->len;
+  regoff_t *found;
+  int i, result, nslot = 2 * (int)(preg->re_nsub + 1);
+
+  if (it->pos < 0 || it->pos > (regoff_t)it->len) return -1;
+  p = it->text + it->pos;
+  if (preg->lit) {
+    p = scan_literal(p, text_end, preg->lit);
+    if (!p) {
+      it->pos = -1;
+      return -1;
+    }
+    if (!preg->lit->prefix) p = it->text + it->pos;
+  }
+  if (it->vm) {
+    pike_reset(it->vm);
+    result = pike_search(it->vm, it->text, it->len, p - it->text);
+    found = it->vm->found;
+  } else if (it->pos > 0 && preg->atoms->type == RE_TYPE_BEGIN && !(preg->cflags & REG_NEWLINE)) {
+    result = -1;
+    found = NULL;
+  } else {
+    result = backtrack(it->rs, p);
+    found = it->rs->caps;
+  }
+  if (result != 0) {
+    it->pos = -1;
+    return it->rs && it->rs->nomem ? REG_ESPACE : -1;
+  }
+  for (i = 0; i < nmatch; i++) {
+    pmatch[i].rm_so = (2 * i < nslot) ? found[2 * i] : -1;
+    pmatch[i].rm_eo = (2 * i < nslot) ? found[2 * i + 1] : -1;
+  }
+  /* an empty match can't be found twice at the same place */
+  it->pos = found[1] + (found[0] == found[1]);
+  return 0;
+}
+
+void
+regiter_free(regiter_t *it)
+{
+  const regex_t *preg = it->preg;
+  if (it->rs) {
+    state_release(it->rs);
+    preg->free_fn(preg->alloc_ctx, it->rs);
+  }
+  if (it->vm) preg->free_fn(preg->alloc_ctx, it->vm);
+  it->rs = NULL;
+  it->vm = NULL;
+}
+
+/*
+ * calls fn with every match in the first len bytes of text, like regiter_next()
+ * finds them. Stops when fn returns non-zero.
+ * Returns the number of matches, -1 if out of memory.
+ */
+int
+regexec_all(const regex_t *preg, const char *text, size_t len, regstream_fn_t fn, void *ctx)
+{
+  regiter_t it;
+  size_t nmatch = preg->re_nsub + 1;
+  regmatch_t *pmatch = preg->alloc_fn(preg->alloc_ctx, sizeof(regmatch_t) * nmatch);
+  int result, count = 0;
+  if (!pmatch) return -1;
+  if (regiter_init(&it, preg, text, len) != 0) {
+    preg->free_fn(preg->alloc_ctx, pmatch);
+    return -1;
+  }
+  while ((result = regiter_next(&it, nmatch, pmatch)) == 0) {
+    count++;
+    if (fn(ctx, nmatch, pmatch)) break;
+  }
+  if (result == REG_ESPACE) count = -1;
+  regiter_free(&it);
+  preg->free_fn(preg->alloc_ctx, pmatch);
+  return count;
+}
+
+/*
+ * calls fn with the range of each line of text that has a match, without its
+ * \n, as pmatch[0]. With REG_NEWLINE the buffer is searched as a whole and
+ * the lines a match falls in are found after it; otherwise each line is
+ * matched by itself. Returns the number of lines, -1 if out of memory,
+ * even in the middle of the buffer.
+ */
+int
+regexec_lines(const regex_t *preg, const char *text, size_t len, regstream_fn_t fn, void *ctx)
+{
+  const char *text_end = text + len, *ls, *le;
+  regmatch_t m, line;
+  regiter_t it;
+  int result, count = 0;
+
+  if (!(preg->cflags & REG_NEWLINE)) {
+    for (ls = text; ls < text_end; ls = le + 1) {
+      le = scan_newline(ls, text_end);
+      if (!le) le = text_end;
+      result = regnexec(preg, ls, le - ls, 0, NULL, 0);
+      if (result == REG_ESPACE) return -1;
+      if (result != 0) continue;
+      line.rm_so = ls - text;
+      line.rm_eo = le - text;
+      count++;
+      if (fn(ctx, 1, &line)) break;
+    }
+    return count;
+  }
+  if (regiter_init(&it, preg, text, len) != 0) return -1;
+  while ((result = regiter_next(&it, 1, &m)) == 0) {
+    /* no line starts after a final \n */
+    if (m.rm_so == (regoff_t)len && len > 0 && text[len - 1] == '\n') break;
+    for (ls = text + m.rm_so; ls > text && ls[-1] != '\n'; ls--);
+    le = scan_newline(text + m.rm_so, text_end);
+    if (!le) le = text_end;
+    /* a match running over \n doesn't count, but the line may still have one */
+    if (text + m.rm_eo > le && (result = regnexec(preg, ls, le - ls, 0, NULL, 0)) == REG_ESPACE) break;
+    if (text + m.rm_eo <= le || result == 0) {
+      line.rm_so = ls - text;
+      line.rm_eo = le - text;
+      count++;
+      if (fn(ctx, 1, &line)) break;
+    }
+    it.pos = le - text + 1;
+  }
+  regiter_free(&it);
+  return result == REG_ESPACE ? -1 : count;
+}
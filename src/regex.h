@@ -5,6 +5,11 @@
 #include <stddef.h>
 
 typedef struct re_atom ReAtom;
+typedef struct re_prog ReProg;
+typedef struct re_lit ReLit;
+typedef struct re_pike RePike;
+typedef struct re_state ReState;
+typedef struct re_dfa ReDfa;
 
 typedef void *(*regex_alloc_fn_t)(void *ctx, size_t size);
 typedef void (*regex_free_fn_t)(void *ctx, void *ptr);
@@ -12,16 +17,86 @@ typedef void (*regex_free_fn_t)(void *ctx, void *ptr);
 typedef struct {
   size_t re_nsub;  // number of parenthesized subexpressions ( )
   ReAtom *atoms;
+  ReProg *prog;    // NFA program for the Pike VM, NULL when the backtracker is used
+  ReProg *rprog;   // program of the reversed pattern run backward from the end of text, NULL if none
+  ReLit *lit;      // literal every match has to contain, NULL if none
+  const void *image; // set by regload(): atoms, lit and prog lie in it
+  int cflags;
+  size_t dfa_cache_size; // bytes of lazy DFA states for REG_NOSUB, 0 disables the DFA
+  uint8_t first[32];   // 256-bit set of the bytes a match can start with
+  uint8_t has_first;   // every match starts with a byte in first[]
+  uint8_t onepass;     // the backtracker never has to go back, see onepass_init()
   void *alloc_ctx;
   regex_alloc_fn_t alloc_fn;
   regex_free_fn_t free_fn;
 } regex_t;
 
+typedef ptrdiff_t regoff_t; // offset in the text, -1 if none
+
 typedef struct {
-  int16_t rm_so; // start position of match
-  int16_t rm_eo; // end position of match
+  regoff_t rm_so; // start position of match
+  regoff_t rm_eo; // end position of match
 } regmatch_t;
 
+/*
+ * many patterns matched in one pass over the text
+ */
+typedef struct {
+  size_t count;    // number of patterns
+  regex_t *pats;   // each pattern parsed
+  ReProg *prog;    // all patterns in one program
+  ReDfa *dfa;      // lazy DFA keeping its states between calls, NULL until regset_exec() makes it
+  size_t dfa_cache_size; // bytes of lazy DFA states, at least one state always fits
+  void *alloc_ctx;
+  regex_alloc_fn_t alloc_fn;
+  regex_free_fn_t free_fn;
+} regset_t;
+
+/* number of uint32_t words regset_exec() needs for count patterns */
+#define REGSET_WORDS(count) (((count) + 31) / 32)
+
+/*
+ * matching a text fed in chunks
+ */
+typedef int (*regstream_fn_t)(void *ctx, size_t nmatch, const regmatch_t *pmatch);
+
+typedef struct {
+  const regex_t *preg;
+  ReProg *prog;        // program made for the stream when preg has none
+  RePike *vm;
+  char *history;       // ring of the last history_size bytes fed
+  size_t history_size;
+  regoff_t fed;        // bytes fed so far
+  regoff_t pos;        // position the matcher is at, -1 once no more match can come
+  regmatch_t *pmatch;  // re_nsub + 1 of them passed to fn
+  regstream_fn_t fn;   // called for each match, returns non-zero to stop the stream
+  void *ctx;
+} regstream_t;
+
+/*
+ * iterating over the matches in a text
+ */
+typedef struct {
+  const regex_t *preg;
+  const char *text;
+  size_t len;
+  regoff_t pos;        // where the next search starts, -1 once no more match can come
+  RePike *vm;          // scratch of the Pike VM, NULL on the backtracker
+  ReState *rs;         // scratch of the backtracker, NULL on the Pike VM
+} regiter_t;
+
+/*
+ * scratch space reused by every match of a pattern
+ */
+typedef struct {
+  const regex_t *preg;
+  RePike *vm;          // Pike VM, NULL on the backtracker
+  ReDfa *dfa;          // lazy DFA keeping its states between calls, NULL if disabled or on the backtracker
+  ReDfa *rdfa;         // lazy DFA of preg->rprog, NULL if none
+  ReState *rs;         // backtracker, NULL on the Pike VM
+  size_t max_steps;    // budget of each call as in regnexec_limit(), 0 for none
+} regctx_t;
+
 /* regcomp() flags */
 #define	REG_BASIC       0000
 #define	REG_EXTENDED    0001
@@ -31,10 +106,36 @@ typedef struct {
 #define	REG_NOSPEC      0020
 #define	REG_PEND        0040
 #define	REG_DUMP        0200
+#define	REG_PIKEVM      04000 // force the linear-time Pike VM engine
+
+/* regexec() results besides 0 for a match and -1 for none */
+#define	REG_ESTEPS      (-2) // regnexec_limit() ran out of steps
+#define	REG_ESPACE      (-3) // out of memory
 
 int regcomp(regex_t *preg, const char *pattern, int cflags,
             void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn);
 void regfree(regex_t *preg);
-int regexec(regex_t *preg, const char *string, size_t nmatch, regmatch_t *pmatch, int eflags);
+size_t regsave(const regex_t *preg, void *buf, size_t size);
+int regload(regex_t *preg, const void *image, size_t size,
+            void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn);
+int regexec(const regex_t *preg, const char *string, size_t nmatch, regmatch_t *pmatch, int eflags);
+int regnexec(const regex_t *preg, const char *string, size_t len, size_t nmatch, regmatch_t *pmatch, int eflags);
+int regnexec_limit(const regex_t *preg, const char *string, size_t len, size_t nmatch, regmatch_t *pmatch,
+                   int eflags, size_t max_steps);
+int regctx_init(regctx_t *ctx, const regex_t *preg);
+int regctx_exec(regctx_t *ctx, const char *string, size_t len, size_t nmatch, regmatch_t *pmatch, int eflags);
+void regctx_free(regctx_t *ctx);
+int regset_comp(regset_t *set, const char *const *patterns, size_t count, int cflags,
+                void *alloc_ctx, regex_alloc_fn_t alloc_fn, regex_free_fn_t free_fn);
+int regset_exec(regset_t *set, const char *string, size_t len, uint32_t *matched, int eflags);
+void regset_free(regset_t *set);
+int regstream_init(regstream_t *st, const regex_t *preg, size_t history_size, regstream_fn_t fn, void *ctx);
+int regstream_feed(regstream_t *st, const char *chunk, size_t len);
+int regstream_finish(regstream_t *st);
+int regiter_init(regiter_t *it, const regex_t *preg, const char *string, size_t len);
+int regiter_next(regiter_t *it, size_t nmatch, regmatch_t *pmatch);
+void regiter_free(regiter_t *it);
+int regexec_all(const regex_t *preg, const char *string, size_t len, regstream_fn_t fn, void *ctx);
+int regexec_lines(const regex_t *preg, const char *string, size_t len, regstream_fn_t fn, void *ctx);
 
 #endif /* !REGEX_LIGHT_H_ */
@@ -7,26 +7,35 @@
 static void *libc_alloc(void *ctx, size_t size) { (void)ctx; return malloc(size); }
 static void libc_free(void *ctx, void *ptr) { (void)ctx; free(ptr); }
 
+static int allocs; // calls of count_alloc()
+static void *count_alloc(void *ctx, size_t size) { (void)ctx; allocs++; return malloc(size); }
+
+static int fail_at; // the allocation of fail_alloc() that fails, 0 for none
+static void *fail_alloc(void *ctx, size_t size) { (void)ctx; return --fail_at == 0 ? NULL : malloc(size); }
+
+static unsigned char dirt; // byte dirty_alloc() fills the next block with
+static void *dirty_alloc(void *ctx, size_t size) { void *p = malloc(size); (void)ctx; if (p) memset(p, ++dirt, size); return p; }
+
 int exit_code = 0;
+int extra_cflags = 0;
 
 void
-assert_match(char *regexp, char *text, int num, ...)
+vassert_match(char *regexp, char *text, size_t len, int num, va_list list)
 {
-  va_list list;
   char *expected;
-  char actual[100];
-  char message[171];
+  char actual[len + 1];
+  char message[len * 2 + 71];
   int i, j, k;
 
   regex_t preg;
-  regcomp(&preg, regexp, REG_EXTENDED|REG_NEWLINE, NULL, libc_alloc, libc_free);
+  regcomp(&preg, regexp, REG_EXTENDED|REG_NEWLINE|extra_cflags, NULL, libc_alloc, libc_free);
   regmatch_t pmatch[preg.re_nsub + 1]; // number of subexpression + 1
 
   char not[] = " NOT ";
   if (num > 0) not[1] = '\0';
-  printf("\n(re_nsub: %d)<- /%s/ should%smatch \"%s\"\n", (int)preg.re_nsub, regexp, not, text);
+  printf("\n(re_nsub: %d)<- /%s/ should%smatch \"%.*s\"\n", (int)preg.re_nsub, regexp, not, (int)len, text);
 
-  if (regexec(&preg, text, preg.re_nsub + 1, pmatch, 0) == 0) {
+  if (regnexec(&preg, text, len, preg.re_nsub + 1, pmatch, 0) == 0) {
     if (num != 0) {
       fprintf(stdout, " \e[32;1msucceeded to match\e[m\n");
     } else {
@@ -39,8 +48,7 @@ assert_match(char *regexp, char *text, int num, ...)
       exit_code = 1;
     }
 
-    va_start(list, num);
-    for (i = 0; i < num; i++) {
+    for (i = 0; i < num && !(extra_cflags & REG_NOSUB); i++) {
       expected = va_arg(list, char*);
       k = 0;
       for (j = pmatch[i].rm_so; j < pmatch[i].rm_eo; j++) {
@@ -56,7 +64,6 @@ assert_match(char *regexp, char *text, int num, ...)
         exit_code = 1;
       }
     }
-    va_end(list);
   } else {
     if (num == 0) {
       fprintf(stdout, " \e[32;1msucceeded  to match\e[m\n");
@@ -69,10 +76,457 @@ assert_match(char *regexp, char *text, int num, ...)
   regfree(&preg);
 }
 
-int
-main(void)
+void
+assert_match(char *regexp, char *text, int num, ...)
+{
+  va_list list;
+  va_start(list, num);
+  vassert_match(regexp, text, strlen(text), num, list);
+  va_end(list);
+}
+
+/* only the first len bytes of text are matched */
+void
+assert_nmatch(char *regexp, char *text, size_t len, int num, ...)
+{
+  va_list list;
+  va_start(list, num);
+  vassert_match(regexp, text, len, num, list);
+  va_end(list);
+}
+
+void
+assert_nosub(char *regexp, char *text, size_t cache_size, int expected)
+{
+  regex_t preg;
+  regcomp(&preg, regexp, REG_NOSUB, NULL, libc_alloc, libc_free);
+  preg.dfa_cache_size = cache_size;
+  int actual = (regexec(&preg, text, 0, NULL, 0) == 0);
+  printf("\n(cache: %d)<- /%s/ should%smatch \"%s\"\n", (int)cache_size, regexp, expected ? " " : " NOT ", text);
+  if (actual == expected) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed\e[m\n");
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/*
+ * the backtracker, the Pike VM and the lazy DFA give the same answer, and
+ * the first two the same groups, whether or not captures are asked for
+ */
+void
+assert_engines(char *regexp, int cflags, char *text)
+{
+  regex_t bt, pike, dfa;
+  regmatch_t expected[4], actual[4];
+  int result, pike_result, dfa_result, nocap_result;
+  regcomp(&bt, regexp, REG_EXTENDED|cflags, NULL, libc_alloc, libc_free);
+  regcomp(&pike, regexp, REG_EXTENDED|REG_PIKEVM|cflags, NULL, libc_alloc, libc_free);
+  regcomp(&dfa, regexp, REG_EXTENDED|REG_NOSUB|cflags, NULL, libc_alloc, libc_free);
+  memset(expected, 0xFF, sizeof(expected));
+  memset(actual, 0xFF, sizeof(actual));
+  result = regexec(&bt, text, 4, expected, 0);
+  pike_result = regexec(&pike, text, 4, actual, 0);
+  dfa_result = regexec(&dfa, text, 0, NULL, 0);
+  nocap_result = regexec(&bt, text, 0, NULL, 0);
+  printf("\n(%d)<- /%s/ should match \"%s\" the same on every engine\n", result, regexp, text);
+  if (pike_result == result && dfa_result == result && nocap_result == result &&
+      memcmp(expected, actual, sizeof(expected)) == 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: Pike VM %d, DFA %d, no captures %d\e[m\n", pike_result, dfa_result, nocap_result);
+    exit_code = 1;
+  }
+  regfree(&bt);
+  regfree(&pike);
+  regfree(&dfa);
+}
+
+/* as assert_nosub(), with the nth allocation of regexec() failing */
+void
+assert_nosub_oom(char *regexp, char *text, int nth, int expected)
+{
+  regex_t preg;
+  regcomp(&preg, regexp, REG_NOSUB, NULL, fail_alloc, libc_free);
+  fail_at = nth;
+  int actual = (regexec(&preg, text, 0, NULL, 0) == 0);
+  fail_at = 0;
+  printf("\n(allocation %d fails)<- /%s/ should%smatch \"%s\"\n", nth, regexp, expected ? " " : " NOT ", text);
+  if (actual == expected) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed\e[m\n");
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/* expected has the bit of each pattern id that should match, on each of two calls */
+void
+assert_set(const char **patterns, size_t count, char *text, size_t cache_size, uint32_t expected)
+{
+  regset_t set;
+  uint32_t matched[REGSET_WORDS(count)], again[REGSET_WORDS(count)];
+  int i, n = 0, first;
+  regset_comp(&set, patterns, count, 0, NULL, libc_alloc, libc_free);
+  set.dfa_cache_size = cache_size;
+  printf("\n(set of %d, cache: %d)<- \"%s\" should match %08x\n", (int)count, (int)cache_size, text, expected);
+  for (i = 0; i < 32; i++) n += (expected >> i) & 1;
+  first = regset_exec(&set, text, strlen(text), matched, 0);
+  if (first == n && matched[0] == expected &&
+      regset_exec(&set, text, strlen(text), again, 0) == n && again[0] == expected) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: %08x\e[m\n", matched[0]);
+    exit_code = 1;
+  }
+  regset_free(&set);
+}
+
+static int
+stream_collect(void *ctx, size_t nmatch, const regmatch_t *pmatch)
+{
+  char *out = ctx;
+  size_t i;
+  for (i = 0; i < nmatch; i++) {
+    sprintf(out + strlen(out), "%s%d-%d", i ? ":" : (out[0] ? " " : ""),
+            (int)pmatch[i].rm_so, (int)pmatch[i].rm_eo);
+  }
+  return 0;
+}
+
+/* text is fed chunk bytes at a time, expected lists "so-eo:so-eo..." of each match */
+void
+assert_stream(char *regexp, char *text, size_t chunk, size_t history_size, char *expected)
+{
+  regex_t preg;
+  regstream_t st;
+  char actual[256] = "";
+  size_t i, len = strlen(text);
+  int result = 0;
+  regcomp(&preg, regexp, extra_cflags, NULL, libc_alloc, libc_free);
+  regstream_init(&st, &preg, history_size, stream_collect, actual);
+  for (i = 0; i < len && result == 0; i += chunk) {
+    result = regstream_feed(&st, text + i, len - i < chunk ? len - i : chunk);
+  }
+  if (result == 0) result = regstream_finish(&st);
+  else regstream_finish(&st);
+  printf("\n(chunk: %d)<- /%s/ should find \"%s\" in \"%s\"\n", (int)chunk, regexp, expected, text);
+  if ((expected ? result == 0 && strcmp(actual, expected) == 0 : result == -1)) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: \"%s\" (%d)\e[m\n", actual, result);
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/* expected lists "so-eo:so-eo..." of each match */
+void
+assert_all(char *regexp, char *text, char *expected)
+{
+  regex_t preg;
+  char actual[256] = "";
+  regcomp(&preg, regexp, extra_cflags, NULL, libc_alloc, libc_free);
+  int count = regexec_all(&preg, text, strlen(text), stream_collect, actual);
+  printf("\n(%d found)<- /%s/ should find \"%s\" in \"%s\"\n", count, regexp, expected, text);
+  if (strcmp(actual, expected) == 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: \"%s\"\e[m\n", actual);
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/* expected lists "so-eo" of each matching line */
+void
+assert_lines(char *regexp, int cflags, char *text, char *expected)
+{
+  regex_t preg;
+  char actual[256] = "";
+  regcomp(&preg, regexp, cflags | extra_cflags, NULL, libc_alloc, libc_free);
+  int count = regexec_lines(&preg, text, strlen(text), stream_collect, actual);
+  printf("\n(%d lines)<- /%s/ should find \"%s\"\n", count, regexp, expected);
+  if (strcmp(actual, expected) == 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: \"%s\"\e[m\n", actual);
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/*
+ * regexec_lines() with the nth allocation after regcomp() failing returns -1.
+ * cflags only: a pattern with a program is matched by the lazy DFA, which
+ * falls back to the Pike VM when it can't have memory.
+ */
+void
+assert_lines_oom(char *regexp, int cflags, char *text, int nth)
+{
+  regex_t preg;
+  char actual[256] = "";
+  regcomp(&preg, regexp, cflags, NULL, fail_alloc, libc_free);
+  fail_at = nth;
+  int count = regexec_lines(&preg, text, strlen(text), stream_collect, actual);
+  fail_at = 0;
+  printf("\n(allocation %d fails)<- /%s/ should give up on \"%s\"\n", nth, regexp, text);
+  if (count == -1) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: %d lines\e[m\n", count);
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/* a pattern loaded from a moved image matches as the compiled one does */
+void
+assert_image(char *regexp, char *text)
+{
+  regex_t preg, loaded;
+  regmatch_t expected[4], actual[4];
+  int expected_result, actual_result = -1;
+  regcomp(&preg, regexp, REG_EXTENDED|extra_cflags, NULL, libc_alloc, libc_free);
+  size_t size = regsave(&preg, NULL, 0);
+  char *image = malloc(size), *moved = malloc(size);
+  memset(expected, 0xFF, sizeof(expected));
+  memset(actual, 0xFF, sizeof(actual));
+  expected_result = regexec(&preg, text, 4, expected, 0);
+  regsave(&preg, image, size);
+  regfree(&preg);
+  memcpy(moved, image, size);
+  memset(image, 0, size);
+  if (regload(&loaded, moved, size, NULL, libc_alloc, libc_free) == 0) {
+    actual_result = regexec(&loaded, text, 4, actual, 0);
+    regfree(&loaded);
+  }
+  printf("\n(%d bytes)<- /%s/ loaded from an image should match \"%s\" the same\n", (int)size, regexp, text);
+  if (actual_result == expected_result && memcmp(expected, actual, sizeof(expected)) == 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed\e[m\n");
+    exit_code = 1;
+  }
+  free(image);
+  free(moved);
+}
+
+/*
+ * images of regexp are the same byte for byte whatever memory it was
+ * compiled in, and don't load when cut short. Each 32-bit word after the
+ * magic number set to a big value gives an image that doesn't load or that
+ * matches text without reading outside of it. ccl_at is the offset of a
+ * set offset, whose image must not load then, 0 for none.
+ */
+void
+assert_image_checked(char *regexp, char *text, size_t ccl_at)
+{
+  regex_t preg, loaded;
+  regmatch_t pmatch[4];
+  size_t size, other, cut, at;
+  int32_t big = 0x40000000;
+  int same, cut_ok = 1, ccl_ok = 1;
+  regcomp(&preg, regexp, REG_EXTENDED, NULL, dirty_alloc, libc_free);
+  size = regsave(&preg, NULL, 0);
+  char *image = malloc(size), *again = malloc(size);
+  regsave(&preg, image, size);
+  regfree(&preg);
+  regcomp(&preg, regexp, REG_EXTENDED, NULL, dirty_alloc, libc_free);
+  other = regsave(&preg, again, size);
+  regfree(&preg);
+  same = other == size && memcmp(image, again, size) == 0;
+  for (cut = 0; cut < size; cut++) {
+    char *part = malloc(cut + 1); // exactly cut bytes would be NULL for 0
+    memcpy(part, image, cut);
+    if (regload(&loaded, part, cut, NULL, libc_alloc, libc_free) == 0) {
+      regfree(&loaded);
+      cut_ok = 0;
+    }
+    free(part);
+  }
+  for (at = sizeof(big); at + sizeof(big) <= size; at += sizeof(big)) {
+    memcpy(again, image, size);
+    memcpy(again + at, &big, sizeof(big));
+    if (regload(&loaded, again, size, NULL, libc_alloc, libc_free) == 0) {
+      regexec(&loaded, text, 4, pmatch, 0);
+      regfree(&loaded);
+      if (at == ccl_at) ccl_ok = 0;
+    }
+  }
+  printf("\n(%d bytes)<- /%s/ should give the same image each time, and no image cut short or with a bad offset should load\n", (int)size, regexp);
+  if (same && cut_ok && ccl_ok) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: same %d, cut %d, offset %d\e[m\n", same, cut_ok, ccl_ok);
+    exit_code = 1;
+  }
+  free(image);
+  free(again);
+}
+
+/* regctx_exec() answers as regnexec() does, with no allocation once it has run */
+void
+assert_ctx(char *regexp, char *text)
+{
+  regex_t preg;
+  regctx_t ctx;
+  regmatch_t expected[4], actual[4];
+  int i, expected_result, actual_result, same = 1;
+  size_t len = strlen(text);
+  regcomp(&preg, regexp, REG_EXTENDED|extra_cflags, NULL, count_alloc, libc_free);
+  memset(expected, 0xFF, sizeof(expected));
+  memset(actual, 0xFF, sizeof(actual));
+  expected_result = regnexec(&preg, text, len, 4, expected, 0);
+  regctx_init(&ctx, &preg);
+  actual_result = regctx_exec(&ctx, text, len, 4, actual, 0);
+  allocs = 0;
+  /* every call, not only the last one, as the DFA keeps its states */
+  for (i = 0; i < 6 && same; i++) {
+    if (i > 0) actual_result = regctx_exec(&ctx, text, len, 4, actual, 0);
+    same = actual_result == expected_result && memcmp(expected, actual, sizeof(expected)) == 0;
+  }
+  printf("\n<- /%s/ on a context should match \"%s\" as regnexec() does\n", regexp, text);
+  if (same && allocs == 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: %d (%d allocations)\e[m\n", actual_result, allocs);
+    exit_code = 1;
+  }
+  regctx_free(&ctx);
+  regfree(&preg);
+}
+
+/* a pattern ending with $ matches backward as it does forward */
+void
+assert_reverse(char *regexp, char *text)
+{
+  regex_t preg;
+  regmatch_t expected[4], actual[4];
+  int expected_result, actual_result;
+  regcomp(&preg, regexp, REG_EXTENDED|extra_cflags, NULL, libc_alloc, libc_free);
+  void *rprog = preg.rprog;
+  memset(expected, 0xFF, sizeof(expected));
+  memset(actual, 0xFF, sizeof(actual));
+  actual_result = regexec(&preg, text, 4, actual, 0);
+  preg.rprog = NULL;
+  expected_result = regexec(&preg, text, 4, expected, 0);
+  preg.rprog = rprog;
+  printf("\n(%d)<- /%s/ should match \"%s\" backward as forward\n", expected_result, regexp, text);
+  if (rprog && actual_result == expected_result && memcmp(expected, actual, sizeof(expected)) == 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: %d%s\e[m\n", actual_result, rprog ? "" : " (no reversed program)");
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+void
+assert_bad(char *regexp)
+{
+  regex_t preg;
+  int result = regcomp(&preg, regexp, REG_EXTENDED|extra_cflags, NULL, libc_alloc, libc_free);
+  printf("\n/%s/ should not compile\n", regexp);
+  if (result != 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed\e[m\n");
+    regfree(&preg);
+    exit_code = 1;
+  }
+}
+
+/* regset_comp() and regstream_init(), which run the Pike VM, refuse regexp */
+void
+assert_backtracker_only(char *regexp)
+{
+  regex_t preg;
+  regset_t set;
+  regstream_t st;
+  const char *patterns[] = { regexp };
+  int set_result, stream_result;
+  regcomp(&preg, regexp, REG_EXTENDED|extra_cflags, NULL, libc_alloc, libc_free);
+  set_result = regset_comp(&set, patterns, 1, REG_EXTENDED, NULL, libc_alloc, libc_free);
+  stream_result = regstream_init(&st, &preg, 0, stream_collect, NULL);
+  printf("\n/%s/ should be refused by regset_comp() and regstream_init()\n", regexp);
+  if (preg.prog == NULL && set_result != 0 && stream_result != 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: %d %d\e[m\n", set_result, stream_result);
+    if (set_result == 0) regset_free(&set);
+    if (stream_result == 0) regstream_finish(&st);
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/* onepass tells whether the one-pass matcher should be picked */
+void
+assert_onepass(char *regexp, char *text, int onepass)
 {
+  regex_t preg;
+  regmatch_t expected[4], actual[4];
+  int expected_result, actual_result;
+  regcomp(&preg, regexp, REG_EXTENDED|extra_cflags, NULL, libc_alloc, libc_free);
+  int picked = preg.onepass == (onepass && !preg.prog); // never over the Pike VM
+  memset(expected, 0xFF, sizeof(expected));
+  memset(actual, 0xFF, sizeof(actual));
+  actual_result = regexec(&preg, text, 4, actual, 0);
+  preg.onepass = 0;
+  expected_result = regexec(&preg, text, 4, expected, 0);
+  printf("\n(%d)<- /%s/ should match \"%s\" %sin one pass\n", expected_result, regexp, text, onepass ? "" : "not ");
+  if (picked && actual_result == expected_result && memcmp(expected, actual, sizeof(expected)) == 0) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: %d%s\e[m\n", actual_result, picked ? "" : " (wrong matcher)");
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
 
+/* expected is the result of regnexec_limit() */
+void
+assert_steps(char *regexp, char *text, size_t max_steps, int expected)
+{
+  regex_t preg;
+  regmatch_t pmatch[4];
+  regcomp(&preg, regexp, REG_EXTENDED|extra_cflags, NULL, libc_alloc, libc_free);
+  int result = regnexec_limit(&preg, text, strlen(text), 4, pmatch, 0, max_steps);
+  printf("\n(steps: %d)<- /%s/ on \"%s\" should return %d\n", (int)max_steps, regexp, text, expected);
+  if (result == expected) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed: %d\e[m\n", result);
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+/* a match of regexp can only start with one of bytes, NULL if any byte */
+void
+assert_first(char *regexp, char *bytes)
+{
+  regex_t preg;
+  uint8_t expected[32] = { 0 };
+  regcomp(&preg, regexp, REG_EXTENDED, NULL, libc_alloc, libc_free);
+  for (char *b = bytes; b && *b; b++) expected[(uint8_t)*b >> 3] |= 1 << (*b & 7);
+  printf("\n<- /%s/ should start with one of \"%s\"\n", regexp, bytes ? bytes : "(any byte)");
+  if (bytes ? preg.has_first && memcmp(preg.first, expected, sizeof(expected)) == 0 : !preg.has_first) {
+    fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+  } else {
+    fprintf(stderr, " \e[31;1mfailed\e[m\n");
+    exit_code = 1;
+  }
+  regfree(&preg);
+}
+
+void
+test_all(void)
+{
   printf("\n");
   {
     assert_match("a", "a", 1, "a");
@@ -162,6 +616,20 @@ main(void)
     assert_match("z[B0-9AC]+[b-d]+a", "z1A5BC08ddcbda9", 1, "z1A5BC08ddcbda");
     assert_match("z[B0-9AC]+[b-d]+a", "z1A5RC08ddcbda9", 0);
   }
+  { /* [^ ] and class escapes */
+    assert_match("[^abc]+", "abcxyzb", 1, "xyz");
+    assert_match("[^abc]", "abc", 0);
+    assert_match("a[^]]b", "a]bacb", 1, "acb");
+    assert_match("[\\d_]+", "ab1_2c", 1, "1_2");
+    assert_match("[\\]]+", "a]]b", 1, "]]");
+    assert_match("[a-]+", "b-a-c", 1, "-a-");
+    assert_match("[-a]+", "b-a-c", 1, "-a-");
+    assert_match("\\W+", "ab, cd", 1, ", ");
+    assert_match("\\D+", "12ab34", 1, "ab");
+    assert_match("\\S+", " \tab c", 1, "ab");
+    assert_match("[\\W\\d]+", "ab1-2c", 1, "1-2");
+    assert_nmatch("a[^b]c", "a\0c", 3, 1, "a\0c");
+  }
   { /* * */
     assert_match("ba*", "aba", 1, "ba");
     assert_match("a*", "aa", 1, "aa");
@@ -245,5 +713,436 @@ main(void)
     assert_match("(ab){2,3}c", "abababc", 2, "abababc", "ab");
     assert_match("(ab){2,}c", "abababababc", 2, "abababababc", "ab");
   }
+  { /* capture slots don't grow with the text */
+    char *long_text = malloc(30001);
+    memset(long_text, 'x', 29998);
+    strcpy(long_text + 29998, "ab");
+    assert_match("(a)(b)$", long_text, 3, "ab", "a", "b");
+    free(long_text);
+    long_text = malloc(4003);
+    for (int i = 0; i < 4000; i += 2) memcpy(long_text + i, "ab", 2);
+    strcpy(long_text + 4000, "c");
+    assert_match("(ab)*c$", long_text, 2, long_text, "ab");
+    assert_match("(ab){3,}c$", long_text, 2, long_text, "ab");
+    assert_match("x(ab){3,}c", long_text, 0);
+    free(long_text);
+    assert_match("(a)(x)?(b)", "ab", 4, "ab", "a", "", "b");
+    assert_match("a(b(c)d)*e", "abcdbcde", 3, "abcdbcde", "bcd", "c");
+    assert_match("(a)(b)(c)(d)(e)(f)(g)(h)(i)(j)(k)(l)", "abcdefghijkl", 13,
+                 "abcdefghijkl", "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l");
+    assert_match("((((((((((((a))))))))))))", "a", 13,
+                 "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a");
+  }
+  { /* offsets past 32767 and no limit on groups */
+    char *long_text = malloc(100001);
+    memset(long_text, 'x', 99994);
+    strcpy(long_text + 99994, "abbbc!");
+    assert_match("a(b+)c", long_text, 2, "abbbc", "bbb");
+    assert_match("(b+)c!$", long_text, 2, "bbbc!", "bbb");
+    free(long_text);
+
+    char pattern[401], text[101];
+    regex_t preg;
+    regmatch_t pmatch[101];
+    int i, ok = 1;
+    for (i = 0; i < 100; i++) {
+      memcpy(pattern + i * 3, "(a)", 3);
+      text[i] = 'a';
+    }
+    pattern[300] = text[100] = '\0';
+    regcomp(&preg, pattern, extra_cflags, NULL, libc_alloc, libc_free);
+    ok = (preg.re_nsub == 100 && regexec(&preg, text, 101, pmatch, 0) == 0);
+    for (i = 1; ok && i <= 100 && !(extra_cflags & REG_NOSUB); i++) {
+      ok = (pmatch[i].rm_so == i - 1 && pmatch[i].rm_eo == i);
+    }
+    regfree(&preg);
+    for (i = 0; i < 100; i++) {
+      pattern[i] = '(';
+      pattern[101 + i] = ')';
+    }
+    pattern[100] = 'a';
+    pattern[201] = '\0';
+    regcomp(&preg, pattern, extra_cflags, NULL, libc_alloc, libc_free);
+    ok = ok && (preg.re_nsub == 100 && regexec(&preg, text, 101, pmatch, 0) == 0);
+    for (i = 1; ok && i <= 100 && !(extra_cflags & REG_NOSUB); i++) {
+      ok = (pmatch[i].rm_so == 0 && pmatch[i].rm_eo == 1);
+    }
+    regfree(&preg);
+    printf("\n(re_nsub: 100)<- 100 groups side by side and nested 100 deep should match\n");
+    if (ok) {
+      fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+    } else {
+      fprintf(stderr, " \e[31;1mfailed\e[m\n");
+      exit_code = 1;
+    }
+  }
+  { /* streaming */
+    assert_stream("a(b+)c", "xabcyabbbcz", 1, 0, "1-4:2-3 5-10:6-9");
+    assert_stream("a(b+)c", "xabcyabbbcz", 3, 0, "1-4:2-3 5-10:6-9");
+    assert_stream("a(b+)c", "xabcyabbbcz", 100, 0, "1-4:2-3 5-10:6-9");
+    assert_stream("a*", "baaa", 1, 0, "0-0 1-4 4-4");
+    assert_stream("^ab", "abab", 1, 0, "0-2");
+    assert_stream("b$", "abab", 1, 0, "3-4");
+    assert_stream("(a|ab)(c|bcd)", "xabcd abcd", 2, 0, "1-5:1-2:2-5 6-10:6-7:7-10");
+    assert_stream("a.*z|b", "a-b-z-b", 1, 0, "0-5 6-7"); // 0-5 is settled at the end, then -b is searched again
+    assert_stream("a.*z|ab", "ab-ab-ab-z ab-ab-ab", 4, 0, "0-10 11-13 14-16 17-19");
+    assert_stream("a.*z|ab", "ab-ab-ab-z ab-ab-ab", 4, 4, NULL); // too late to go back to 10
+    assert_stream("x", "", 1, 0, "");
+  }
+  { /* all matches */
+    assert_all("a(b+)c", "xabcyabbbcz", "1-4:2-3 5-10:6-9");
+    assert_all("a*", "baaa", "0-0 1-4 4-4");
+    assert_all("[0-9]+", "a1b22c333", "1-2 3-5 6-9");
+    assert_all("^ab", "abab", "0-2");
+    assert_all("b$", "abab", "3-4");
+    assert_all("x", "abab", "");
+    assert_all("", "ab", "0-0 1-1 2-2");
+    assert_all("ERROR: ([0-9]+)", "ERROR: 1 ok ERROR: 22", "0-8:7-8 12-21:19-21");
+    assert_all("(a|ab)(c|bcd)", "xabcd abcd", "1-5:1-2:2-5 6-10:6-7:7-10");
+  }
+  { /* REG_NEWLINE */
+    assert_match("^b", "a\nb", 1, "b");
+    assert_match("a$", "a\nb", 1, "a");
+    assert_match("^b$", "a\nb\nc", 1, "b");
+    assert_match("a.b", "a\nb", 0);
+    assert_match("a[^x]b", "a\nb", 0);
+    assert_match("a\\sb", "a\nb", 1, "a\nb");
+    assert_match("a$\n^b", "a\nb", 1, "a\nb");
+    assert_match("(^|-)x", "a\nx", 2, "x", "");
+    assert_match("^ERROR", "x ERROR\nERROR", 1, "ERROR");
+    assert_lines("ERROR", REG_NEWLINE, "ok\nERROR 1\nok\nERROR 2\n", "3-10 14-21");
+    assert_lines("ERROR", 0, "ok\nERROR 1\nok\nERROR 2\n", "3-10 14-21");
+    assert_lines("^$", REG_NEWLINE, "a\n\nb\n", "2-2");
+    assert_lines("^$", 0, "a\n\nb\n", "2-2");
+    assert_lines("b$", REG_NEWLINE, "ab\nb x\ncb", "0-2 7-9");
+    assert_lines("a\\sb", REG_NEWLINE, "a\nb", "");
+    /* more groups than fit on the stack, so each line takes an allocation */
+    assert_lines_oom("()()()()()()()()()()()()()()()()b", REG_EXTENDED, "x\nab\nb", 1);
+    assert_lines_oom("()()()()()()()()()()()()()()()()b", REG_EXTENDED, "x\nab\nb", 2);
+    assert_lines("z$", REG_NEWLINE, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaz\nzz\nzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzy", "0-41 42-44");
+  }
+  { /* saved image */
+    assert_image("a(b+)c", "xabbbcy");
+    assert_image("ERROR: ([0-9]+)", "x ERROR: 42");
+    assert_image("[a-c]+x[^0-9]{2}$", "aabbccxyz");
+    assert_image("(GET|POST|PUT) /(\\w+)", "x PUT /index");
+    assert_image("(a*)*b", "aaab");
+    assert_image("^ab|cd$", "xxcd");
+    assert_image("x", "abc");
+  }
+  { /* reverse search */
+    assert_reverse("\\.(jpg|png)$", "a.png.jpg");
+    assert_reverse("\\.(jpg|png)$", "a.png.gif");
+    assert_reverse("status=([0-9]+)$", "x status=1 status=42");
+    assert_reverse("status=([0-9]+)$", "status=42 x");
+    assert_reverse("(ab)?c$", "zabc");
+    assert_reverse("(ab)+$", "aababab");
+    assert_reverse("a[0-9]*$", "a1a22");
+    assert_reverse("[a-c]{2,3}$", "xabcab");
+    assert_reverse("x*$", "aaa");
+    assert_reverse("(^a|b)c$", "ac");
+    assert_reverse("(^a|b)c$", "xac");
+    assert_reverse("a.b$", "a\nb");
+    assert_reverse("(a|ab)(c|bcd)$", "xabcd");
+  }
+  { /* one-pass */
+    assert_onepass("([0-9]+)-([0-9]+)-([0-9]+)", "tel 03-1234-5678", 1);
+    assert_onepass("([0-9]+)-([0-9]+)-([0-9]+)", "03-1234-", 1);
+    assert_onepass("key=([a-z]+);", "key=ab key=value;", 1);
+    assert_onepass("x[0-9]{2,5}y", "x1y x123456y x1234y", 1);
+    assert_onepass("^ab?c*$", "abccc", 1);
+    assert_onepass("^ab?c*$", "abccd", 1);
+    assert_onepass("a[0-9]*\\.?[0-9]+", "a12.5", 0); // [0-9]* can give back to [0-9]+
+    assert_onepass("a*ab", "aaab", 0);
+    assert_onepass("(ab)+c", "ababc", 0);
+    assert_onepass("a|b", "b", 0);
+    assert_onepass("a.*b", "axxbxb", 0);
+    assert_onepass("a[^b]*b", "axxbxb", 1);
+    assert_onepass("a{0}b", "aab", 1); // a{0} is a*
+  }
+  { /* possessive quantifiers and atomic groups */
+    assert_match("a*+b", "aaab", 1, "aaab");
+    assert_match("a*a", "aaa", 1, "aaa"); // gives one back
+    assert_match("a*+a", "aaa", 0);
+    assert_match("a+a", "aaa", 1, "aaa");
+    assert_match("a++a", "aaa", 0);
+    assert_match("x[0-9]++1", "x121", 0);
+    assert_match("x[0-9]++y", "x12y", 1, "x12y");
+    assert_match("a?+a", "a", 0);
+    assert_match("a?+b", "ab", 1, "ab");
+    assert_match("a{1,3}+a", "aaa", 0);
+    assert_match("a{1,3}+a", "aaaa", 1, "aaaa");
+    assert_match("(ab)*ab", "ababab", 2, "ababab", "ab");
+    assert_match("(ab)*+ab", "ababab", 0);
+    assert_match("(ab)*+c", "ababc", 2, "ababc", "ab");
+    assert_match("(a*)a", "aaa", 2, "aaa", "aa"); // goes back into the group
+    assert_match("(?>a*)a", "aaa", 0);
+    assert_match("(\\w+)\\d", "ab1", 2, "ab1", "ab");
+    assert_match("(?>\\w+)\\d", "ab1", 0);
+    assert_match("(a+){2}", "aaa", 2, "aaa", "a");
+    assert_match("(?>a+){2}", "aaa", 0); // each repetition is atomic
+    assert_match("(?>a+){2}", "aaba", 0);
+    assert_match("(?>(a+))(a)", "aaa", 0);
+    assert_match("((a+))(a)", "aaa", 4, "aaa", "aa", "aa", "a");
+    assert_match("(?>a*)b", "aab", 1, "aab");
+    assert_match("(?>(a)b)(c)", "xabc", 3, "abc", "a", "c");
+    assert_match("(?>ab)+c", "ababc", 1, "ababc");
+    assert_match("(a*+)*b", "aab", 2, "aab", "aa");
+    assert_match("a++", "baa", 1, "aa");
+    assert_onepass("[0-9a-z]*+[0-9]", "ab12", 1);
+    assert_image("x[0-9]++(?>y)", "x12y");
+    assert_bad("(?>a|ab)c");
+    assert_bad("a*+|b");
+    assert_backtracker_only("a*+b");
+    assert_backtracker_only("(?>ab)c");
+  }
+  { /* exec context */
+    assert_ctx("a(b+)c", "xabbbcy");
+    assert_ctx("ERROR: ([0-9]+)", "x ERROR: 42");
+    assert_ctx("(ab)*c", "abababababababababababababababababababc");
+    assert_ctx("(GET|POST|PUT) /(\\w+)", "x PUT /index");
+    assert_ctx("^ab|cd$", "xabcdx");
+    assert_ctx("x", "abc");
+    assert_ctx("ab|cd", "zcd");
+    assert_ctx("(a|b)*c", "abac");
+    assert_ctx("c*$", "a");
+    assert_ctx("b+$", "1axb");
+  }
+  { /* step budget */
+    char aaa[128];
+    memset(aaa, 'a', 100);
+    strcpy(aaa + 100, "bxbc");
+    assert_steps("a*a*a*bc", aaa, 50, REG_ESTEPS);
+    assert_steps("a*a*a*bc", aaa, 0, 0); // no limit
+    assert_steps("a(b+)c", "xabbbcy", 1000, 0);
+    assert_steps("a(b+)c", "xabbbcy", 2, REG_ESTEPS);
+    assert_steps("a(b+)c", "xy", 2, -1); // rejected before any step
+  }
+  { /* length-aware */
+    assert_nmatch("b+", "abbbc", 3, 1, "bb");
+    assert_nmatch("c$", "abc", 2, 0);
+    assert_nmatch("b$", "abc", 2, 1, "b");
+    assert_nmatch("(b*)$", "abbc", 3, 2, "bb", "bb");
+    assert_nmatch("c[0-9]", "ab\0c1", 5, 1, "c1");
+    assert_nmatch("b[a-z]?c", "ab\0c", 4, 0);
+    assert_nmatch("a", "", 0, 0);
+  }
+  { /* required literal */
+    assert_match("ERROR: ([0-9]+)", "INFO: ok", 0);
+    assert_match("ERROR: ([0-9]+)", "x ERROR: ERROR: 42", 2, "ERROR: 42", "42");
+    assert_match("^ERROR", "x ERROR", 0);
+    assert_match("^a.bcd", "aXbcd", 1, "aXbcd");
+    assert_match("x[0-9]+abc", "x12ab x12abc", 1, "x12abc");
+    assert_match("x[0-9]+abc", "x12ab x12ab", 0);
+    assert_match("a{3}b", "aab aaab", 1, "aaab");
+    assert_match("ab{0}c", "abbc", 1, "abbc");
+    assert_match("ab?c", "ac", 1, "ac");
+    assert_match("needle", "nxxxxe needl needle nee", 1, "needle");
+    assert_match("needle", "nxxxxe needl neexle nee needlE needlenxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxe", 1, "needle");
+    assert_match("needle", "nxxxxe needl neexle nee needlE nxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxe needl", 0);
+    assert_match("z", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaz", 1, "z");
+  }
+  { /* REG_ICASE */
+    int cflags = extra_cflags;
+    extra_cflags |= REG_ICASE;
+    assert_match("error: ([0-9]+)", "x ERROR: 42", 2, "ERROR: 42", "42");
+    assert_match("Get|post", "x POST /", 1, "POST");
+    assert_match("[a-c]+x", "zzAbCX", 1, "AbCX");
+    assert_match("[^a-c]+", "aBcDeF", 1, "DeF");
+    assert_match("[^x]y", "Xy", 0);
+    assert_match("\\w+", "-AbC-", 1, "AbC");
+    assert_match("a{2}b", "aAB", 1, "aAB");
+    assert_match("@", "@`[{", 1, "@");
+    assert_match("@", "`", 0);
+    extra_cflags = cflags;
+  }
+  { /* positions no match can start at are skipped */
+    assert_match("[0-9]+x", "ab1c22x", 1, "22x");
+    assert_match("(ab)?c", "zzabc", 2, "abc", "ab");
+    assert_match("(ab)?c", "zzaxc", 2, "c", "");
+    assert_match("x*y", "aaay", 1, "y");
+    assert_match("a?b?c", "zzbzc", 1, "c");
+    assert_match("[a-c]{0,2}d", "xxbd", 1, "bd");
+    assert_match("(x(y)z)+w", "xyxyzw", 3, "xyzw", "xyz", "y");
+    assert_match("[0-9]+x", "abc", 0);
+    assert_match("b*$", "abc", 1, "");
+    assert_match("(ab|c)d", "xcd", 2, "cd", "c");
+  }
+  { /* nested quantifiers run on the Pike VM */
+    assert_match("(a*)*b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0);
+    assert_match("(a*)*b", "aaab", 2, "aaab", "aaa");
+    assert_match("(\\w+)+$", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa!", 0);
+    assert_match("(\\w+)+$", "log line", 2, "line", "line");
+    assert_match("(a+)+", "aaa", 2, "aaa", "aaa");
+    assert_match("x(a?b)*y", "xabbaby", 2, "xabbaby", "ab");
+  }
+  { /* alternation */
+    assert_match("a|b", "cba", 1, "b");
+    assert_match("a\\|b", "ab a|b", 1, "a|b");
+    assert_match("(a|b)", "a", 2, "a", "a");
+    assert_match("(GET|POST|PUT) /", "xx PUT /index", 2, "PUT /", "PUT");
+    assert_match("(GET|POST|PUT) /", "PUTS /", 0);
+    assert_match("(a|ab)c", "abc", 2, "abc", "ab");
+    assert_match("(ab|a)(bc|c)", "abc", 3, "abc", "ab", "c");
+    assert_match("x(a|)y", "xy", 2, "xy", "");
+    assert_match("x(|a)y", "xay", 2, "xay", "a");
+    assert_match("(a|b|c)+d", "zcabbad", 2, "cabbad", "a");
+    assert_match("(a|[0-9]+|b.)x", "b7x 12x", 2, "b7x", "b7");
+    assert_match("^ab|cd$", "xxcd", 1, "cd");
+    assert_match("^ab|cd$", "abxx", 1, "ab");
+    assert_match("^ab|cd$", "xabcdx", 0);
+    assert_match("(foo|bar(baz|qux))!", "barqux!", 3, "barqux!", "barqux", "qux");
+    assert_match("(a|b)*$", "abba", 2, "abba", "a");
+    assert_match("(x|$)", "ab", 2, "", "");
+    assert_match("(c|d)|(a|b)", "xb", 3, "b", "", "b");
+    assert_match("(a|b|c|d|e|f|g|h|i|j|k|l|m|n|o|p|q|r|s|t|u|v|w|x|y|z|"
+                 "A|B|C|D|E|F|G|H|I|J|K|L|M|N|O|P|Q|R|S|T|U|V|W|X|Y|Z|"
+                 "0|1|2|3|4|5|6|7|8|9|_|-|@)+!", "..zZ9@-!", 2, "zZ9@-!", "-");
+  }
+}
+
+int
+main(void)
+{
+  test_all();
+  {
+    regex_t preg;
+    long image[8] = { 0 };
+    printf("\n<- a broken image should not load\n");
+    if (regload(&preg, image, sizeof(image), NULL, libc_alloc, libc_free) == -1) {
+      fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+    } else {
+      fprintf(stderr, " \e[31;1mfailed\e[m\n");
+      exit_code = 1;
+    }
+  }
+  { /* images of the same pattern, cut short or with a bad offset */
+    assert_image_checked("[a-c]x", "zbx", 36); // the set offset of the first atom, after the 32-byte header and its type
+    assert_image_checked("x[0-9]+(y|z)$", "ax12z", 0);
+    assert_image_checked("(a|[bc])*d|e{2,3}", "cbde", 0);
+    assert_image_checked("k(ey)=(\\w+)", "a key=val", 0);
+  }
+  { /* repetitions are frames on the heap, not C stack frames */
+    regex_t preg;
+    regmatch_t pmatch[2];
+    size_t i, n = 200000;
+    char *text = malloc(2 * n + 2);
+    for (i = 0; i < n; i++) memcpy(text + 2 * i, "ab", 2);
+    strcpy(text + 2 * n, "c");
+    regcomp(&preg, "(ab)*c", REG_EXTENDED, NULL, libc_alloc, libc_free);
+    printf("\n<- /(ab)*c/ should match %d repetitions\n", (int)n);
+    if (regexec(&preg, text, 2, pmatch, 0) == 0 && pmatch[0].rm_eo == 2 * n + 1 && pmatch[1].rm_so == 2 * n - 2) {
+      fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+    } else {
+      fprintf(stderr, " \e[31;1mfailed\e[m\n");
+      exit_code = 1;
+    }
+    regfree(&preg);
+    free(text);
+  }
+  printf("\n--- Pike VM ---\n");
+  extra_cflags = REG_PIKEVM;
+  test_all();
+  { /* a budget spent to the last step is not exceeded */
+    assert_steps("a(b+)c", "xabbbcy", 14, 0);
+    assert_steps("a(b+)c", "xabbbcy", 13, REG_ESTEPS);
+    assert_steps("a(b+)c", "xabbby", 13, -1);
+    assert_steps("a(b+)c", "xabbby", 12, REG_ESTEPS);
+  }
+  printf("\n--- lazy DFA ---\n");
+  extra_cflags = REG_NOSUB;
+  test_all();
+  { /* a budget spent to the last byte is not exceeded */
+    assert_steps("a(b+)c", "xabbbcy", 5, 0);
+    assert_steps("a(b+)c", "xabbbcy", 4, REG_ESTEPS);
+    assert_steps("a(b+)c", "xabbby", 5, -1);
+    assert_steps("a(b+)c", "xabbby", 4, REG_ESTEPS);
+    assert_steps("[x][y]", "abc", 3, -1);
+    assert_steps("[x][y]", "abc", 2, REG_ESTEPS);
+  }
+  { /* tiny caches are reset over and over */
+    assert_nosub("[a-c]+x[0-9]{2}$", "aabbccx1aabcx12", 256, 1);
+    assert_nosub("[a-c]+x[0-9]{2}$", "aabbccx1aabcx123", 256, 0);
+    assert_nosub("(ab|cd)*e", "abcdabcdabcde", 160, 1);
+    assert_nosub("a.c", "abc", 16, 1); // no room for a state, falls back to the Pike VM
+    assert_nosub("a.c", "abd", 0, 0);  // DFA disabled
+    assert_nosub("^$", "", 4096, 1);
+    assert_nosub("a$", "b", 16, 0); // the reverse search gives up, the forward one answers
+    assert_nosub("a$", "xyz", 16, 0);
+    assert_nosub("a$", "xa", 16, 1);
+    assert_nosub_oom("a$", "b", 1, 0); // no reversed DFA
+    assert_nosub_oom("a$", "xa", 1, 1);
+  }
+  { /* every engine gives the same answer */
+    assert_engines("(.*)x", 0, "abx");
+    assert_engines("(a*)a", 0, "aa");
+    assert_engines("(\\w+)\\d", 0, "ab1");
+    assert_engines("(a?)a", 0, "a");
+    assert_engines("(ab)*ab", 0, "ababab");
+    assert_engines("(a+)(a+)", 0, "aaaa");
+    assert_engines("x(a*)(a*)y", 0, "xaay");
+    assert_engines("(a*)(ab)b", 0, "aaabb");
+    assert_engines("b+(){0,2}", 0, "xaxxb");
+    assert_engines("()+", 0, "a");
+    assert_engines("(a*)+b", 0, "b");
+    assert_engines("(a|b)(a*)a", 0, "baa");
+    assert_engines("$^", 0, "ax"); // a pending $ then ^ is only at the start
+    assert_engines("(b*$)^", 0, "x");
+    assert_engines("^$", 0, "");
+    assert_engines("$^\\s", REG_NEWLINE, "a\n\nb"); // $ and ^ around a line break, then the break after
+    assert_engines("$^\\s", REG_NEWLINE, "\n");
+    assert_engines("a$\\s^b", REG_NEWLINE, "xa\nb");
+    assert_engines("(a*$)\\s+^", REG_NEWLINE, "ba\n\nc");
+    assert_engines("$^", REG_NEWLINE, "a\nb");
+  }
+  { /* bytes a match can start with */
+    assert_first("(ab|c)d", "ac"); // the second branch starts with a byte the first can't
+    assert_first("x(ab|c)", "x");
+    assert_first("(a|(b|c))+d|e", "abce");
+    assert_first("[0-9]+x", "0123456789");
+    assert_first("(ab|)c", NULL); // a branch can be empty
+    assert_first("a|^b", NULL);
+    assert_first("a*", NULL);
+  }
+  { /* regset */
+    const char *rules[] = { "GET /", "POST /", "ERROR: [0-9]+", "^x", "ok$", "(a|b)c", "z*" };
+    assert_set(rules, 7, "GET / ERROR: 42 ok", 0x40000, 0x55);
+    assert_set(rules, 7, "xbc POST /", 0x40000, 0x6a);
+    assert_set(rules, 7, "ok x", 0x40000, 0x40);
+    assert_set(rules, 7, "", 0x40000, 0x40);
+    assert_set(rules, 7, "GET / ERROR: 42 ok", 0, 0x55); // cache is raised to one state
+    assert_set(rules + 3, 1, "yx", 0x40000, 0);
+  }
+  { /* many rules, one pass */
+    char patterns[300][32];
+    const char *rules[300];
+    regset_t set;
+    uint32_t matched[REGSET_WORDS(300)];
+    int i;
+    for (i = 0; i < 300; i++) {
+      sprintf(patterns[i], "rule%d=([0-9]+);", i);
+      rules[i] = patterns[i];
+    }
+    regset_comp(&set, rules, 300, 0, NULL, count_alloc, libc_free);
+    i = regset_exec(&set, "x rule7=1; rule299=42; rule12=; rule120=3;", 42, matched, 0);
+    printf("\n(set of 300)<- rule7, rule120 and rule299 should match\n");
+    if (i == 3 && matched[0] == (1u << 7) && matched[3] == (1u << 24) && matched[9] == (1u << 11)) {
+      fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+    } else {
+      fprintf(stderr, " \e[31;1mfailed\e[m\n");
+      exit_code = 1;
+    }
+    /* the states of the first call are kept, and match again */
+    allocs = 0;
+    i = regset_exec(&set, "rule7=2; rule8=", 15, matched, 0);
+    printf("\n(set of 300, again)<- rule7 should match with no allocation\n");
+    if (i == 1 && matched[0] == (1u << 7) && matched[3] == 0 && allocs == 0) {
+      fprintf(stdout, " \e[32;1msucceeded\e[m\n");
+    } else {
+      fprintf(stderr, " \e[31;1mfailed: %d allocations\e[m\n", allocs);
+      exit_code = 1;
+    }
+    regset_free(&set);
+  }
   return exit_code;
 }
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "src/regex.h"
+
+/*
+ * The matchers regexgen made from the patterns below (see the Makefile)
+ * have to answer as regnexec() does on every text.
+ */
+
+#define NMATCH 4
+
+static void *libc_alloc(void *ctx, size_t size) { (void)ctx; return malloc(size); }
+static void libc_free(void *ctx, void *ptr) { (void)ctx; free(ptr); }
+
+typedef int (*matcher_t)(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+
+int match_date(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_kv(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_method(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_mail(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_repeat(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_nested(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_empty(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_anchor(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_star(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_back(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_head(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+int match_line(const char *text, size_t len, size_t nmatch, regmatch_t *pmatch);
+
+typedef struct {
+  matcher_t fn;
+  char *regexp;
+  int cflags;
+} Case;
+
+static Case cases[] = {
+  { match_date,   "([0-9]+)-([0-9]+)-([0-9]+)", 0 },
+  { match_kv,     "key=([a-z]+);",              0 },
+  { match_method, "(GET|POST|PUT) /(\\w+)",     0 },
+  { match_mail,   "[^ @]+@[a-z]+\\.(com|org)",  0 },
+  { match_repeat, "x(ab){2,3}y?",               0 },
+  { match_nested, "(a*)*b",                     0 },
+  { match_empty,  "x(|a)*y",                    0 },
+  { match_anchor, "^ab|cd$",                    0 },
+  { match_star,   "a.*",                        0 },
+  { match_back,   "(a*)ab",                     0 }, // the backtracker goes back into the group
+  { match_head,   "^key=(\\w+)",                0 }, // a literal only at the start
+  { match_line,   "^ERROR: (.*)$",              REG_NEWLINE },
+};
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+static char *texts[] = {
+  "", "a", "2026-10-17", "on 1-2-3 or 44-55-66", "key=abc;", "key=;key=xy;",
+  "x PUT /index", "POST /", "me@example.com, you@ex.org", "xababy", "xabababy",
+  "xaby", "aaaaaaaaaaaaaaaaaaaaaaaaaab", "aaaaaaaaaaaaaaaaaaaaaaaaaa", "xaay", "xy",
+  "abxx", "aaab", "xxcd", "xabcdx", "ok\nERROR: disk full\nok", "ERROR: \n",
+  "kkey=key=k;key=ab;", "key=v1 key=v2", "ke", "x-1-2", NULL, // a long one, see main()
+};
+#define NTEXTS (sizeof(texts) / sizeof(texts[0]))
+
+int
+main(void)
+{
+  regex_t preg;
+  regmatch_t expected[NMATCH], actual[NMATCH];
+  int i, j, expected_result, actual_result, failures = 0;
+  char *text;
+
+  /* long enough for the matchers that backtrack to need their bitmap */
+  text = malloc(4096);
+  memset(text, 'a', 4000);
+  strcpy(text + 4000, " key=@x.com 1-2-");
+  texts[NTEXTS - 1] = text;
+  for (i = 0; i < NCASES; i++) {
+    regcomp(&preg, cases[i].regexp, REG_EXTENDED | cases[i].cflags, NULL, libc_alloc, libc_free);
+    for (j = 0; j < NTEXTS; j++) {
+      size_t len = strlen(texts[j]);
+      memset(expected, 0xFF, sizeof(expected));
+      memset(actual, 0xFF, sizeof(actual));
+      expected_result = regnexec(&preg, texts[j], len, NMATCH, expected, 0);
+      actual_result = cases[i].fn(texts[j], len, NMATCH, actual);
+      if (actual_result != expected_result ||
+          (expected_result == 0 && memcmp(expected, actual, sizeof(expected)) != 0)) {
+        fprintf(stderr, " \e[31;1m/%s/ on \"%s\" differed\e[m\n", cases[i].regexp, texts[j]);
+        failures++;
+      }
+    }
+    regfree(&preg);
+  }
+
+  free(text);
+  printf("\n%d generated matchers x %d texts\n", (int)NCASES, (int)NTEXTS);
+  if (failures == 0) {
+    fprintf(stdout, " \e[32;1mall results matched\e[m\n");
+    return 0;
+  }
+  fprintf(stderr, " \e[31;1m%d results differed\e[m\n", failures);
+  return 1;
+}
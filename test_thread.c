@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "src/regex.h"
+
+/*
+ * Many threads share each compiled pattern and match it at once.
+ * Every result has to be the same as the single threaded one.
+ */
+
+#define THREADS 8
+#define ROUNDS  2000
+#define NMATCH  4
+
+static void *libc_alloc(void *ctx, size_t size) { (void)ctx; return malloc(size); }
+static void libc_free(void *ctx, void *ptr) { (void)ctx; free(ptr); }
+
+typedef struct {
+  char *regexp;
+  int cflags;
+  char *text;
+  regex_t preg;
+  int expected;
+  regmatch_t pmatch[NMATCH];
+} Case;
+
+static Case cases[] = {
+  { "a(b+)c",           0,         "xxabbbcyy" },
+  { "((ab)cd)e",        0,         "zzabcdez" },
+  { "(ab)?c",           0,         "abc" },
+  { "(ab)*c",           0,         "abababc" },
+  { "(ab)+c",           0,         "xabababc" },
+  { "(ab){2,3}c",       0,         "abababc" },
+  { "^([0-9_]+)",       0,         "123_abc" },
+  { "a(bcd)ef(hello)",  0,         "aabcdefhello" },
+  { "a(b)c",            0,         "adbc" },
+  { "(\\w+)+$",         0,         "log line" },
+  { "(GET|POST|PUT) /(\\w+)", 0, "x PUT /index" },
+  { "[a-c]+x[0-9]{2}$", REG_NOSUB, "aabbccx12" },
+};
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+static void *
+worker(void *arg)
+{
+  int *failures = (int *)arg;
+  regmatch_t pmatch[NMATCH];
+  int round, i, result;
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < NCASES; i++) {
+      Case *c = &cases[(i + round) % NCASES];
+      memset(pmatch, 0, sizeof(pmatch));
+      result = regexec(&c->preg, c->text, NMATCH, pmatch, 0);
+      if (result != c->expected ||
+          (result == 0 && !(c->cflags & REG_NOSUB) &&
+           memcmp(pmatch, c->pmatch, sizeof(pmatch)) != 0)) {
+        (*failures)++;
+      }
+    }
+  }
+  return NULL;
+}
+
+int
+main(void)
+{
+  pthread_t threads[THREADS];
+  int failures[THREADS] = { 0 };
+  int i, total = 0;
+
+  for (i = 0; i < NCASES; i++) {
+    Case *c = &cases[i];
+    regcomp(&c->preg, c->regexp, c->cflags, NULL, libc_alloc, libc_free);
+    memset(c->pmatch, 0, sizeof(c->pmatch));
+    c->expected = regexec(&c->preg, c->text, NMATCH, c->pmatch, 0);
+  }
+  for (i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, &failures[i]);
+  }
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    total += failures[i];
+  }
+  for (i = 0; i < NCASES; i++) {
+    regfree(&cases[i].preg);
+  }
+
+  printf("\n%d threads x %d rounds x %d patterns\n", THREADS, ROUNDS, (int)NCASES);
+  if (total == 0) {
+    fprintf(stdout, " \e[32;1mall results matched\e[m\n");
+    return 0;
+  }
+  fprintf(stderr, " \e[31;1m%d results differed\e[m\n", total);
+  return 1;
+}